@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include "b_io.h"
 #include "fsLow.h"
 #include "mfs.h"
@@ -31,14 +32,27 @@
 #define MAXFCBS 20
 #define B_CHUNK_SIZE 512
 
+// blocks reserved ahead of a growing file: as many as it has, within
+// these bounds
+#define B_PREALLOC_MIN 8
+#define B_PREALLOC_MAX 256
+
+// blocks b_defrag copies with each write
+#define B_DEFRAG_CHUNK 64
+
 // This is the form of the structure returned by GetFileInfo
 typedef struct fileInfo {
-    char fileName[64];      // filename
+    char fileName[256];     // filename, up to 255 characters
     int fileSize;           // file size in bytes
     int location;           // starting lba (block number) for the file data
     int blockSize;
     fat_file_blockinfo *blockInfo;
 
+    int isInline;                       // data kept in the directory entry
+    char inlineData[FS_INLINE_MAX];
+    int inlineDirty;                    // inlineData written since open
+    int retired;                        // moved by b_defrag, old chain kept until close
+
     fdDir *dir;
 } fileInfo;
 
@@ -58,59 +72,124 @@ typedef struct b_fcb
 	int buflen;		//holds how many valid bytes are in the buffer
 
     uint64_t currPosition;      // current position
+    int flags;                  // flags given to open
 
     char *blockBuffer;
     int bufferedBlockNumber;
+    int blockDirty;             // blockBuffer written since it was read
+    int keepBlocks;             // blocks kept at close: those at open and b_fallocate's
 	} b_fcb;
 	
 b_fcb fcbArray[MAXFCBS];
 
 int startup = 0;	//Indicates that this has not been initialized
 
-fileInfo * GetFileInfo (char * filename, int flags)
+int bPreallocMax = B_PREALLOC_MAX;
+
+void b_set_prealloc(int maxBlocks)
 {
-    // open current directory
-    fdDir * curDir = fs_opendir(".");
-    if (curDir == NULL) {
-        fprintf(stderr, "ERROR: cannot open current directory\n");
-        exit(1);
+    bPreallocMax = maxBlocks;
+}
+
+int b_get_prealloc(void)
+{
+    return bPreallocMax;
+}
+
+// Fill file info of the file described by di in directory dir, which the
+// file info takes over. If di is NULL the file does not exist yet and is
+// created as name when flags has O_CREAT.
+fileInfo * GetFileInfoIn (fdDir * dir, struct fs_diriteminfo * di, char * name, int flags)
+{
+    if (di != NULL && di->fileType != FT_REGFILE) {
+        // directories (including . and ..) cannot be opened as files
+        fs_closedir(dir);
         return NULL;
     }
 
-    // find file and open it
-    struct fs_diriteminfo * di;
-    di = fs_readdir(curDir);
-    while (di != NULL) {
-        /* skips entries for current and parent directories */
-        if ((strcmp(di->d_name, ".") == 0)
-            || (strcmp(di->d_name, "..") == 0)) {
-            di = fs_readdir(curDir);
-            continue;
+    // create if cannot find
+    if (di == NULL) {
+        if (flags & O_CREAT) {
+            di = fs_create(dir, name);
         }
-        if (strcmp(di->d_name, filename) == 0) {
-            break;
+        if (di == NULL) {
+            fs_closedir(dir);
+            return NULL;
         }
-        di = fs_readdir(curDir);
     }
 
-    // create if cannot find
-    if (di == NULL && (flags & O_CREAT)) {
-        di = fs_create(curDir, filename);
+    // O_TRUNC detaches the old blocks before they would be mapped
+    struct fs_diriteminfo empty;
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY
+        && (di->size > 0 || di->startLocationLBA != 0)) {
+        if (fs_truncate_file(dir, di->d_name) < 0) {
+            fs_closedir(dir);
+            return NULL;
+        }
+        empty = *di;
+        empty.size = 0;
+        empty.startLocationLBA = 0;
+        empty.mapBlocks = 0;
+        di = &empty;
     }
 
-    fileInfo * fi = NULL;
-    if (di != NULL) {
-        fi = calloc(1, sizeof(fileInfo));
-        strncpy(fi->fileName, di->d_name, sizeof(fi->fileName) - 1);
-        fi->fileSize = di->size;
-        fi->location = di->startLocationLBA;
+    fileInfo * fi = calloc(1, sizeof(fileInfo));
+    strncpy(fi->fileName, di->d_name, sizeof(fi->fileName) - 1);
+    fi->fileSize = di->size;
+    fi->location = fs_lba_block(di->startLocationLBA);
+    fi->dir = dir;
+    if (fi->location == 0) {
+        // tiny file, no blocks to map
+        fi->isInline = 1;
+        if (fs_get_inline(dir, fi->fileName, fi->inlineData) < 0) {
+            fi->fileSize = 0;
+        }
+        fi->blockInfo = fat_new_file_blockinfo();
+    }
+    else if (di->mapBlocks > 0) {
+        // sparse file, blocks come from its map
+        fi->blockInfo = fat_get_file_map(fi->location, di->mapBlocks, fi->fileSize);
+    }
+    else {
         fi->blockInfo = fat_get_file_blockinfo(fi->location);
-        fi->dir = curDir;
+    }
+    if (fi->blockInfo != NULL) {
+        fi->blockInfo->dir_lba = dir->directoryStartLocation;
     }
 
     return fi;
 }
 
+fileInfo * GetFileInfo (char * filename, int flags, int * error)
+{
+    // resolve path once
+    struct fs_lookup_result result;
+    int status = fs_lookup(filename, &result);
+    if (status == FS_LOOKUP_TOOLONG || status == FS_LOOKUP_NOTDIR) {
+        // no name that could be created
+        *error = (status == FS_LOOKUP_TOOLONG) ? B_ENAMETOOLONG : B_ENOTDIR;
+        return NULL;
+    }
+    int found = (status == 0);
+
+    // open directory holding the file
+    fdDir * dir = fs_opendir_parent(&result);
+    if (dir == NULL) {
+        return NULL;
+    }
+    return GetFileInfoIn(dir, found ? &result.item : NULL, result.item.d_name, flags);
+}
+
+// file info of name in the directory of dirp, without resolving a path
+fileInfo * GetFileInfoAt (fdDir * dirp, char * name, int flags)
+{
+    if (strchr(name, '/') != NULL) {
+        return NULL;
+    }
+    fdDir * dir = fs_dupdir(dirp);
+    return GetFileInfoIn(dir, fs_findentry(dir, name), name, flags);
+}
+
 //Method to initialize our file system
 void b_init ()
 {
@@ -140,24 +219,18 @@ b_io_fd b_getFCB ()
     return (-1);  //all in use
 }
 	
-// Interface to open a buffered file
-// Modification of interface for this assignment, flags match the Linux flags for open
-// O_RDONLY, O_WRONLY, or O_RDWR
-b_io_fd b_open (char * filename, int flags)
-// flags ignored
+// Give an FCB to the file of info
+b_io_fd b_openinfo (fileInfo * info, int flags)
 {
-    if (startup == 0) b_init();                                   //Initialize our system
-
-    fileInfo * info = GetFileInfo(filename, flags);        // get file info, return distinct negative numbers on errors
-
     if(info == NULL) return -2;                                  // check that this file exists before allocating fd
-    b_io_fd result = b_getFCB(filename);
+    b_io_fd result = b_getFCB();
     if (result < 0) return -3;
 
     // fprintf(stderr, "DEBUG(%s) fileSize=%d\n", __func__, info->fileSize);
 
     fcbArray[result].fi = info;
     fcbArray[result].currPosition = 0;
+    fcbArray[result].flags = flags;
     fileBlockInfo * tempBlockInfo = malloc(sizeof(fileBlockInfo));
     fcbArray[result].blockInfo = tempBlockInfo;
     tempBlockInfo -> blockNumber = -1;
@@ -165,27 +238,139 @@ b_io_fd b_open (char * filename, int flags)
 
     fcbArray[result].blockBuffer = malloc(info->blockInfo->block_size);
     fcbArray[result].bufferedBlockNumber = -1;
+    fcbArray[result].blockDirty = 0;
+    fcbArray[result].keepBlocks = info->blockInfo->total_blocks;
 
     return result;
 }
 
+// Interface to open a buffered file
+// Modification of interface for this assignment, flags match the Linux flags for open
+// O_RDONLY, O_WRONLY, or O_RDWR
+b_io_fd b_open (char * filename, int flags)
+{
+    if (startup == 0) b_init();                                   //Initialize our system
+
+    int error = 0;
+    fileInfo * info = GetFileInfo(filename, flags, &error);        // get file info, return distinct negative numbers on errors
+    if (error != 0) return error;
+    return b_openinfo(info, flags);
+}
+
+// Interface to open a file in an open directory
+b_io_fd b_openat (fdDir * dirp, char * name, int flags)
+{
+    if (startup == 0) b_init();                                   //Initialize our system
+
+    fileInfo * info = GetFileInfoAt(dirp, name, flags);
+    return b_openinfo(info, flags);
+}
+
 // Interface to seek function	
 int b_seek (b_io_fd fd, off_t offset, int whence)
 	{
 	if (startup == 0) b_init();  //Initialize our system
 
 	// check that fd is between 0 and (MAXFCBS-1)
-	if ((fd < 0) || (fd >= MAXFCBS))
+	if ((fd < 0) || (fd >= MAXFCBS) || (fcbArray[fd].fi == NULL))
 		{
 		return (-1); 					//invalid file descriptor
 		}
 		
-		
-	return (0); //Change this
+	b_fcb * fcb = &fcbArray[fd];
+	off_t base;
+	switch (whence)
+		{
+		case SEEK_SET: base = 0; break;
+		case SEEK_CUR: base = fcb->currPosition; break;
+		case SEEK_END: base = fcb->fi->fileSize; break;
+		default: return (-1);
+		}
+	if (base + offset < 0)
+		return (-1);
+
+	// past the end is allowed, writing there leaves a hole
+	fcb->currPosition = base + offset;
+	return (fcb->currPosition);
 	}
 
 
 
+// Write out the buffered block if it was changed. Writes that end within
+// a block leave it in the buffer, so that small writes cost one write of
+// the block, however large, instead of one each.
+void b_flush_block(b_fcb *fcb)
+{
+    if (fcb->blockDirty) {
+        fs_block_write(fcb->blockBuffer, 1, fcb->bufferedBlockNumber);
+        fcb->blockDirty = 0;
+    }
+}
+
+// Move the data of an inline file to its first block. Returns -1, with the
+// file still inline, if the volume is full.
+int promoteInline(b_fcb *fcb)
+{
+    fileInfo *fi = fcb->fi;
+    if (!fi->isInline) {
+        return 0;
+    }
+    if (fi->fileSize == 0) {
+        fi->isInline = 0;
+        return 0;
+    }
+
+    if (fat_add_block(fi->blockInfo) < 0) {
+        return -1;
+    }
+    fi->isInline = 0;
+    int blockNumber = fi->blockInfo->table_blocknumbers[0];
+    memset(fcb->blockBuffer, 0, fi->blockInfo->block_size);
+    memcpy(fcb->blockBuffer, fi->inlineData, fi->fileSize);
+    fs_block_write(fcb->blockBuffer, 1, blockNumber);
+    fcb->bufferedBlockNumber = blockNumber;
+    return 0;
+}
+
+// whether block index of a file reads as zeros without being read: holes
+// and blocks reserved but not written yet
+int b_is_zero_block(fat_file_blockinfo *bi, int index)
+{
+    return fat_is_hole(bi, index) || fat_is_unwritten(bi, index);
+}
+
+// Interface to reserve the blocks of length bytes from offset. The size
+// of the file stays as it is: blocks past its end read as nothing until
+// written, blocks within it read as zeros. The blocks are marked unwritten
+// rather than zeroed, so reserving costs no I/O. Fails with nothing
+// reserved if there are not enough free blocks.
+int b_fallocate (b_io_fd fd, off_t offset, off_t length)
+{
+    if (startup == 0) b_init();  //Initialize our system
+
+    if ((fd < 0) || (fd >= MAXFCBS) || (fcbArray[fd].fi == NULL)
+        || offset < 0 || length <= 0) {
+        return (-1);
+    }
+
+    b_fcb *fcb = &(fcbArray[fd]);
+    if (promoteInline(fcb) < 0) {
+        return (-1);
+    }
+    fat_file_blockinfo *blockInfo = fcb->fi->blockInfo;
+    int blockSize = blockInfo->block_size;
+    int first = offset / blockSize;
+    int last = (offset + length - 1) / blockSize;
+
+    if (fat_reserve_blocks(blockInfo, first, last) < 0) {
+        return (-1);
+    }
+    if (last + 1 > fcb->keepBlocks) {
+        fcb->keepBlocks = last + 1;
+    }
+    return 0;
+}
+
 // Interface to write function	
 int b_write (b_io_fd fd, char * buffer, int count)
 {
@@ -198,8 +383,30 @@ int b_write (b_io_fd fd, char * buffer, int count)
 	}
 
     b_fcb *fcb = &(fcbArray[fd]);
+
+    // every write of an appending file goes at its end
+    if (fcb->flags & O_APPEND) {
+        fcb->currPosition = fcb->fi->fileSize;
+    }
+
+    // stay inline while the data fits in the directory entry
+    if (fcb->fi->isInline) {
+        if (fcb->currPosition + count <= FS_INLINE_MAX) {
+            memcpy(fcb->fi->inlineData + fcb->currPosition, buffer, count);
+            fcb->fi->inlineDirty = 1;
+            fcb->currPosition += count;
+            if (fcb->currPosition > fcb->fi->fileSize) {
+                fcb->fi->fileSize = fcb->currPosition;
+            }
+            return count;
+        }
+        if (promoteInline(fcb) < 0) {
+            return (-1);
+        }
+    }
     fat_file_blockinfo *blockInfo = fcb->fi->blockInfo;
     int blockSize = fcb->fi->blockInfo->block_size;
+    int total = count;
 
     // compute sizes of part 1/2/3
     int offsetPart1, offsetPart2, offsetPart3;      // offsets (of Part 1, 2, 3) aligned to block boundary
@@ -234,55 +441,126 @@ int b_write (b_io_fd fd, char * buffer, int count)
     // allocate block buffer
     char *blockBuffer = fcb->blockBuffer;
 
+    // blocks past the end of the file hold nothing written yet, even if
+    // reserved: they start as zeros, as do blocks marked unwritten. Those
+    // the write skips over stay unwritten, to read as zeros.
+    int eofBlocks = (fcb->fi->fileSize + blockSize - 1) / blockSize;
+    int fresh1 = b_is_zero_block(blockInfo, offsetPart1 / blockSize)
+                 || offsetPart1 / blockSize >= eofBlocks;
+    int fresh3 = b_is_zero_block(blockInfo, offsetPart3 / blockSize)
+                 || offsetPart3 / blockSize >= eofBlocks;
+    for (int i = eofBlocks; i < fcb->currPosition / blockSize; i++) {
+        if (!fat_is_hole(blockInfo, i)) {
+            fat_set_unwritten(blockInfo, i, 1);
+        }
+    }
+
+    int lastIndex = (fcb->currPosition + total - 1) / blockSize;
+    if (bPreallocMax > 0 && total > 0 && fat_is_hole(blockInfo, lastIndex)
+             && fcb->currPosition + total > fcb->fi->fileSize) {
+        // growing past what it has: reserve ahead, doubling the file each
+        // time up to the limit, and give back the unused part at close
+        int window = eofBlocks;
+        if (window < B_PREALLOC_MIN) {
+            window = B_PREALLOC_MIN;
+        }
+        if (window > bPreallocMax) {
+            window = bPreallocMax;
+        }
+        fat_reserve_blocks(blockInfo, fcb->currPosition / blockSize, lastIndex + window);
+    }
+
+    // a block that cannot be mapped ends the write short: the volume is full
+    int full = 0;
+
     // Part 1: first block
     if (sizePart1 > 0) {
-        while (blockInfo->total_blocks < (offsetPart1 / blockSize) + 1) {
-            fat_add_block(blockInfo);
+        int blockNumber = fat_map_block(blockInfo, offsetPart1 / blockSize);
+        if (blockNumber == 0) {
+            return (-1);
         }
-        int blockNumber = blockInfo->table_blocknumbers[offsetPart1 / blockSize];
         if (fcb->bufferedBlockNumber != blockNumber) {
-            LBAread(blockBuffer, 1, blockNumber);
+            b_flush_block(fcb);
+        }
+        if (fresh1) {
+            memset(blockBuffer, 0, blockSize);
+        }
+        else if (fcb->bufferedBlockNumber != blockNumber) {
+            fs_block_read(blockBuffer, 1, blockNumber);
         }
         memcpy(blockBuffer + (fcb->currPosition - offsetPart1), buffer, sizePart1);
-        LBAwrite(blockBuffer, 1, blockNumber);
+        fat_set_unwritten(blockInfo, offsetPart1 / blockSize, 0);
 
-        // record block number of buffered block data
+        // record block number of buffered block data, written once the
+        // buffer moves on
         fcb->bufferedBlockNumber = blockNumber;
+        fcb->blockDirty = 1;
     }
 
-    // Part 2: multiple of blocks
-    for (int i = 0; i < (offsetPart3 - offsetPart2) / blockSize; i++) {
-        while (blockInfo->total_blocks < (offsetPart2 / blockSize) + i + 1) {
-            fat_add_block(blockInfo);
+    // Part 2: multiple of blocks, from the caller's buffer with one write
+    // per run of consecutive blocks
+    int firstWhole = offsetPart2 / blockSize;
+    int wholeBlocks = (offsetPart3 - offsetPart2) / blockSize;
+    for (int i = 0; i < wholeBlocks; ) {
+        int blockNumber = fat_map_block(blockInfo, firstWhole + i);
+        if (blockNumber == 0) {
+            full = 1;
+            sizePart2 = i * blockSize;
+            break;
         }
-        int blockNumber = blockInfo->table_blocknumbers[(offsetPart2 / blockSize) + i];
-        memcpy(blockBuffer, buffer + sizePart1 + i * blockSize, blockSize);
-        LBAwrite(blockBuffer, 1, blockNumber);
-
-        // record block number of buffered block data
-        fcb->bufferedBlockNumber = blockNumber;
+        int n = 1;
+        while (i + n < wholeBlocks
+               && fat_map_block(blockInfo, firstWhole + i + n) == blockNumber + n) {
+            n++;
+        }
+        if (fcb->bufferedBlockNumber >= blockNumber && fcb->bufferedBlockNumber < blockNumber + n) {
+            // buffered block overwritten whole
+            fcb->bufferedBlockNumber = -1;
+            fcb->blockDirty = 0;
+        }
+        fs_block_write(buffer + sizePart1 + i * blockSize, n, blockNumber);
+        for (int j = 0; j < n; j++) {
+            fat_set_unwritten(blockInfo, firstWhole + i + j, 0);
+        }
+        i += n;
     }
 
     // Part 3: last block
+    int lastBlock = (sizePart3 > 0 && !full)
+                    ? fat_map_block(blockInfo, offsetPart3 / blockSize) : 0;
+    if (lastBlock == 0) {
+        sizePart3 = 0;
+    }
     if (sizePart3 > 0) {
-        while (blockInfo->total_blocks < (offsetPart3 / blockSize) + 1) {
-            fat_add_block(blockInfo);
+        // keep what follows in the block unless it is new
+        int blockNumber = lastBlock;
+        if (fcb->bufferedBlockNumber != blockNumber) {
+            b_flush_block(fcb);
+        }
+        if (fresh3) {
+            memset(blockBuffer, 0, blockSize);
+        }
+        else if (fcb->bufferedBlockNumber != blockNumber) {
+            fs_block_read(blockBuffer, 1, blockNumber);
         }
-        int blockNumber = blockInfo->table_blocknumbers[(offsetPart3 / blockSize)];
-        memset(blockBuffer, 0, blockSize);
         memcpy(blockBuffer, buffer + sizePart1 + sizePart2, sizePart3);
-        LBAwrite(blockBuffer, 1, blockNumber);
+        fat_set_unwritten(blockInfo, offsetPart3 / blockSize, 0);
 
         // record block number of buffered block data
         fcb->bufferedBlockNumber = blockNumber;
+        fcb->blockDirty = 1;
     }
 
-    fcb->currPosition += sizePart1 + sizePart2 + sizePart3;
+    int written = sizePart1 + sizePart2 + sizePart3;
+    if (written == 0 && total > 0) {
+        return (-1);
+    }
+    fcb->currPosition += written;
     if (fcb->currPosition > fcb->fi->fileSize) {
         fcb->fi->fileSize = fcb->currPosition;
     }
 
-    return (sizePart1 + sizePart2 + sizePart3);
+    return (written);
 }
 
 
@@ -325,7 +603,7 @@ int readNextBlock(b_io_fd fd)
     }
     tempBlockInfo -> blockNumber ++;
     tempBlockInfo->blockOffset = 0;
-    LBAread(tempBlockInfo->blockData, 1,tempBlockInfo->blockNumber);
+    fs_lba_read(tempBlockInfo->blockData, 1,tempBlockInfo->blockNumber);
 }
 
 int b_read (b_io_fd fd, char * buffer, int count)
@@ -343,6 +621,9 @@ int b_read (b_io_fd fd, char * buffer, int count)
     int blockSize = fcb->fi->blockInfo->block_size;
 
     // ensure not exceed end of file
+    if (fcb->currPosition >= fcb->fi->fileSize) {
+        return 0;
+    }
     if ((fcb->currPosition + count) > fcb->fi->fileSize) {
         count = fcb->fi->fileSize - fcb->currPosition;
     }
@@ -351,6 +632,15 @@ int b_read (b_io_fd fd, char * buffer, int count)
         exit(1);
     }
 
+    if (fcb->fi->isInline) {
+        memcpy(buffer, fcb->fi->inlineData + fcb->currPosition, count);
+        fcb->currPosition += count;
+        return count;
+    }
+
+    // blocks read past the buffer come from the volume
+    b_flush_block(fcb);
+
     // compute sizes of Part 1/2/3
     int offsetPart1, offsetPart2, offsetPart3;     // offsets (of Part 1, 2, 3) aligned to block boundary
     int sizePart1, sizePart2, sizePart3;
@@ -394,10 +684,15 @@ int b_read (b_io_fd fd, char * buffer, int count)
     int bytesRead = 0;
 
     // Part 1: first block
-    if (sizePart1 > 0) {
+    if (sizePart1 > 0 && b_is_zero_block(blockInfo, offsetPart1 / blockSize)) {
+        // holes read as zeros
+        memset(buffer, 0, sizePart1);
+        bytesRead += sizePart1;
+    }
+    else if (sizePart1 > 0) {
         int blockNumber = blockInfo->table_blocknumbers[offsetPart1 / blockSize];
         if (fcb->bufferedBlockNumber != blockNumber) {
-            LBAread(blockBuffer, 1, blockNumber);
+            fs_block_read(blockBuffer, 1, blockNumber);
         }
         memcpy(buffer, blockBuffer + (fcb->currPosition - offsetPart1), sizePart1);
         bytesRead += sizePart1;
@@ -406,17 +701,26 @@ int b_read (b_io_fd fd, char * buffer, int count)
         fcb->bufferedBlockNumber = blockNumber;
     }
 
-    // Part 2: multiple of blocks
-    for (int i = 0; i < (offsetPart3 - offsetPart2) / blockSize; i++) {
-        int blockNumber = blockInfo->table_blocknumbers[(offsetPart2 / blockSize) + i];
-        if (fcb->bufferedBlockNumber != blockNumber) {
-            LBAread(blockBuffer, 1, blockNumber);
+    // Part 2: multiple of blocks, into the caller's buffer with one read
+    // per run of consecutive blocks
+    int firstWhole = offsetPart2 / blockSize;
+    int wholeBlocks = (offsetPart3 - offsetPart2) / blockSize;
+    for (int i = 0; i < wholeBlocks; ) {
+        if (b_is_zero_block(blockInfo, firstWhole + i)) {
+            memset(buffer + sizePart1 + i * blockSize, 0, blockSize);
+            bytesRead += blockSize;
+            i++;
+            continue;
         }
-        memcpy(buffer + sizePart1 + i * blockSize, blockBuffer, blockSize);
-        bytesRead += blockSize;
-
-        // record block number of buffered block data
-        fcb->bufferedBlockNumber = blockNumber;
+        int blockNumber = blockInfo->table_blocknumbers[firstWhole + i];
+        int n = 1;
+        while (i + n < wholeBlocks && !b_is_zero_block(blockInfo, firstWhole + i + n)
+               && blockInfo->table_blocknumbers[firstWhole + i + n] == blockNumber + n) {
+            n++;
+        }
+        fs_block_read(buffer + sizePart1 + i * blockSize, n, blockNumber);
+        bytesRead += n * blockSize;
+        i += n;
     }
     if (bytesRead != (sizePart1 + sizePart2)) {
         fprintf(stderr, "ERROR(%s): inproper reading part2\n", __func__);
@@ -424,10 +728,14 @@ int b_read (b_io_fd fd, char * buffer, int count)
     }
 
     // Part 3: last block
-    if (sizePart3 > 0) {
+    if (sizePart3 > 0 && b_is_zero_block(blockInfo, offsetPart3 / blockSize)) {
+        memset(buffer + bytesRead, 0, sizePart3);
+        bytesRead += sizePart3;
+    }
+    else if (sizePart3 > 0) {
         int blockNumber = blockInfo->table_blocknumbers[(offsetPart3 / blockSize)];
         if (fcb->bufferedBlockNumber != blockNumber) {
-            LBAread(blockBuffer, 1, blockNumber);
+            fs_block_read(blockBuffer, 1, blockNumber);
         }
         memcpy(buffer + bytesRead, blockBuffer, sizePart3);
         bytesRead += sizePart3;
@@ -534,13 +842,64 @@ int b_close (b_io_fd fd)
         free(fcbArray[fd].blockInfo);
     }
     if (fcbArray[fd].fi != NULL) {
-        fs_set_fileSize(fcbArray[fd].fi->dir, fcbArray[fd].fi->fileName,
-                        fcbArray[fd].fi->fileSize);
-        fs_closedir(fcbArray[fd].fi->dir);
-        if (fcbArray[fd].fi->blockInfo != NULL) {
-            free(fcbArray[fd].fi->blockInfo->table_blocknumbers);
-            free(fcbArray[fd].fi->blockInfo);
+        fileInfo *fi = fcbArray[fd].fi;
+        b_flush_block(&fcbArray[fd]);
+        if (fi->retired) {
+            // moved by b_defrag while open: the last to close frees the
+            // old chain
+            int last = 1;
+            for (int i = 0; i < MAXFCBS; i++) {
+                fileInfo *other = fcbArray[i].fi;
+                if (i != fd && other != NULL && other != (fileInfo *)-2
+                    && other->retired && other->location == fi->location) {
+                    last = 0;
+                }
+            }
+            if (last) {
+                fat_free_chain(fi->location);
+            }
+        }
+        else {
+            fs_batch_begin();
+            if (fi->isInline && fi->inlineDirty
+                && fs_set_inline(fi->dir, fi->fileName, fi->inlineData, fi->fileSize) < 0) {
+                // no room for the inline record
+                if (promoteInline(&fcbArray[fd]) < 0) {
+                    fprintf(stderr, "ERROR(%s): no room for the data of %s\n",
+                            __func__, fi->fileName);
+                    fi->fileSize = 0;
+                }
+            }
+            fat_file_blockinfo *bi = fi->blockInfo;
+            if (!fi->isInline) {
+                // free the blocks reserved ahead and not written
+                int sizeBlocks = (fi->fileSize + bi->block_size - 1) / bi->block_size;
+                fat_trim_blocks(bi, (sizeBlocks > fcbArray[fd].keepBlocks)
+                                    ? sizeBlocks : fcbArray[fd].keepBlocks);
+                // blocks past the end start as zeros anyway, only those
+                // within it need the map to keep them unwritten
+                for (int i = sizeBlocks; i < bi->total_blocks; i++) {
+                    fat_set_unwritten(bi, i, 0);
+                }
+                int mapped = (fat_put_file_map(bi) == 0);
+                if (bi->head_block != fi->location) {
+                    fs_set_fileLocation(fi->dir, fi->fileName, bi->head_block);
+                    fi->location = bi->head_block;
+                }
+                // block counts are kept unless the chain is just the file
+                int allocBlocks = (mapped || bi->alloc_blocks != sizeBlocks) ? bi->alloc_blocks : 0;
+                if (fs_set_fileMap(fi->dir, fi->fileName, bi->map_blocks, allocBlocks) < 0
+                    && mapped) {
+                    // no room to record the map, write the holes out instead
+                    fat_make_plain(bi);
+                    fs_set_fileLocation(fi->dir, fi->fileName, bi->head_block);
+                }
+            }
+            fs_set_fileSize(fi->dir, fi->fileName, fi->fileSize);
+            fs_batch_end();
         }
+        fs_closedir(fcbArray[fd].fi->dir);
+        fat_free_file_blockinfo(fcbArray[fd].fi->blockInfo);
         free(fcbArray[fd].fi);
     }
     fcbArray[fd].blockInfo = NULL;
@@ -548,3 +907,198 @@ int b_close (b_io_fd fd)
 
     free(fcbArray[fd].blockBuffer);
 }
+
+// fcb open on the file whose chain starts at location, open for writing
+// if writing is set; -1 if there is none. Files moved by b_defrag are
+// left out.
+b_io_fd b_open_on (int location, int writing)
+{
+    for (int i = 0; i < MAXFCBS; i++) {
+        fileInfo *fi = fcbArray[i].fi;
+        if (fi == NULL || fi == (fileInfo *)-2 || fi->retired || fi->location != location) {
+            continue;
+        }
+        if (!writing || (fcbArray[i].flags & O_ACCMODE) != O_RDONLY) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Copy the file item of the directory of dirp to one run of blocks, and
+// point its entry at the run. A fragmented file goes to a run near its
+// directory; with compact set, any file goes to the lowest run if that is
+// below its blocks. Readers that have it open go on reading the old
+// chain, which is freed once they all closed it.
+void b_defrag_at (fdDir * dirp, struct fs_diriteminfo * item, int compact, int kibPerSec,
+                  struct b_defrag_stats * stats, struct timespec * start)
+{
+    struct fs_diriteminfo di = *item;
+    stats->files++;
+    if (di.startLocationLBA == 0 || di.mapBlocks > 0) {
+        // inline files have no blocks, files with holes keep their map
+        return;
+    }
+    int location = fs_lba_block(di.startLocationLBA);
+    if (b_open_on(location, 1) >= 0) {
+        // a writer would put its own chain back at close
+        stats->busy++;
+        return;
+    }
+
+    fat_file_blockinfo *bi = fat_get_file_blockinfo(location);
+    if (bi == NULL) {
+        return;
+    }
+    int extents = 0;
+    int lowest = location;
+    for (int i = 0; i < bi->total_blocks; i++) {
+        if (i == 0 || bi->table_blocknumbers[i] != bi->table_blocknumbers[i - 1] + 1) {
+            extents++;
+        }
+        if (bi->table_blocknumbers[i] < lowest) {
+            lowest = bi->table_blocknumbers[i];
+        }
+    }
+    int target = 0;
+    if (compact) {
+        target = fat_alloc_low_run(bi->total_blocks, lowest);
+    }
+    else if (extents > 1) {
+        bi->dir_lba = dirp->directoryStartLocation;
+        target = fat_alloc_run(bi, bi->total_blocks);
+        stats->noRoom += (target == 0);
+    }
+    if (target == 0) {
+        fat_free_file_blockinfo(bi);
+        return;
+    }
+
+    // read runs of consecutive blocks with one call each, write whole
+    // chunks, keeping to kibPerSec
+    char *buffer = malloc(B_DEFRAG_CHUNK * bi->block_size);
+    for (int i = 0; i < bi->total_blocks; i += B_DEFRAG_CHUNK) {
+        int n = bi->total_blocks - i;
+        if (n > B_DEFRAG_CHUNK) {
+            n = B_DEFRAG_CHUNK;
+        }
+        int *blocks = bi->table_blocknumbers + i;
+        for (int j = 0; j < n; ) {
+            int k = j + 1;
+            while (k < n && blocks[k] == blocks[k - 1] + 1) {
+                k++;
+            }
+            fs_block_read(buffer + j * bi->block_size, k - j, blocks[j]);
+            j = k;
+        }
+        fs_block_write(buffer, n, target + i);
+        stats->blocks += n;
+
+        if (kibPerSec > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+            double due = stats->blocks * bi->block_size / 1024.0 / kibPerSec;
+            if (due > elapsed) {
+                usleep((due - elapsed) * 1e6);
+            }
+        }
+    }
+    free(buffer);
+
+    // swap the chains, unless the file changed meanwhile
+    struct fs_diriteminfo * now = fs_findentry(dirp, di.d_name);
+    if (now == NULL || fs_lba_block(now->startLocationLBA) != location
+        || b_open_on(location, 1) >= 0 || fs_set_fileLocation(dirp, di.d_name, target) < 0) {
+        fat_free_chain(target);
+        stats->busy++;
+        fat_free_file_blockinfo(bi);
+        return;
+    }
+    int readers = 0;
+    for (b_io_fd fd; (fd = b_open_on(location, 0)) >= 0; readers++) {
+        fcbArray[fd].fi->retired = 1;
+    }
+    if (readers == 0) {
+        fat_free_chain(location);
+    }
+    stats->moved++;
+    stats->extentsBefore += extents;
+    stats->extentsAfter++;
+    fat_free_file_blockinfo(bi);
+}
+
+void b_defrag_path (char * path, int compact, int kibPerSec, struct b_defrag_stats * stats,
+                    struct timespec * start)
+{
+    struct fs_lookup_result result;
+    if (fs_lookup(path, &result) != 0) {
+        return;
+    }
+    if (result.item.fileType == FT_REGFILE) {
+        fdDir * dir = fs_opendir_parent(&result);
+        if (dir != NULL) {
+            b_defrag_at(dir, &result.item, compact, kibPerSec, stats, start);
+            fs_closedir(dir);
+        }
+        return;
+    }
+
+    fdDir * dir = fs_opendir_lookup(&result);
+    if (dir == NULL) {
+        return;
+    }
+    struct fs_diriteminfo * di;
+    while ((di = fs_readdir(dir)) != NULL) {
+        if (di->fileType == FT_REGFILE) {
+            b_defrag_at(dir, di, compact, kibPerSec, stats, start);
+        }
+        else if (di->fileType == FT_DIRECTORY
+                 && strcmp(di->d_name, ".") != 0 && strcmp(di->d_name, "..") != 0) {
+            char * child = malloc(strlen(path) + strlen(di->d_name) + 2);
+            sprintf(child, "%s/%s", path, di->d_name);
+            b_defrag_path(child, compact, kibPerSec, stats, start);
+            free(child);
+        }
+    }
+    fs_closedir(dir);
+}
+
+// Interface to rewrite the fragmented files at path, a file or a whole
+// tree, each into one run of blocks
+int b_defrag (char * path, int kibPerSec, struct b_defrag_stats * stats)
+{
+    if (startup == 0) b_init();                                   //Initialize our system
+
+    struct timespec start;
+    memset(stats, 0, sizeof(struct b_defrag_stats));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct fs_lookup_result result;
+    if (fs_lookup(path, &result) != 0) {
+        return -1;
+    }
+    b_defrag_path(path, 0, kibPerSec, stats, &start);
+    return 0;
+}
+
+// Interface to move files down to the lowest free runs, so that the free
+// space gathers at the end of the volume
+int b_compact (int kibPerSec, struct b_defrag_stats * stats)
+{
+    if (startup == 0) b_init();                                   //Initialize our system
+
+    struct timespec start;
+    memset(stats, 0, sizeof(struct b_defrag_stats));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // every move lowers the blocks of a file: go on until none moves, the
+    // blocks freed by a pass free for the next one
+    long moved;
+    do {
+        moved = stats->moved;
+        fs_reclaim();
+        b_defrag_path("/", 1, kibPerSec, stats, &start);
+    } while (stats->moved > moved);
+    fs_reclaim();
+    return 0;
+}
@@ -24,11 +24,40 @@
 
 typedef int b_io_fd;
 
+// b_open fails with a negative number: these two for a bad path, -2 if the
+// file is missing or cannot be created, -3 if no file control block is free
+#define B_ENAMETOOLONG	-4	/* last name of the path too long */
+#define B_ENOTDIR	-5	/* path ends with '/' and is not a directory */
 b_io_fd b_open (char * filename, int flags);
 int b_read (b_io_fd fd, char * buffer, int count);
 int b_write (b_io_fd fd, char * buffer, int count);
 int b_seek (b_io_fd fd, off_t offset, int whence);
+int b_fallocate (b_io_fd fd, off_t offset, off_t length);	// keeps the file size
+
+// Files growing through writes reserve up to maxBlocks blocks ahead,
+// freed at close if not written; 0 turns this off
+void b_set_prealloc (int maxBlocks);
+int b_get_prealloc (void);
 int b_close (b_io_fd fd);
 
+// Rewrites the files at path (a file or a whole tree) that are in more
+// than one run of blocks into a single run, copying at most kibPerSec
+// KiB/s (0 for no limit). Files open for writing are skipped.
+struct b_defrag_stats
+	{
+	long files;		/* files looked at */
+	long moved;		/* files rewritten */
+	long busy;		/* skipped, open for writing */
+	long noRoom;		/* skipped, no free run long enough */
+	long extentsBefore;	/* runs of the files rewritten, before */
+	long extentsAfter;	/* and after */
+	long blocks;		/* blocks copied */
+	};
+int b_defrag (char * path, int kibPerSec, struct b_defrag_stats * stats);
+
+// Moves files down to the lowest free runs, so that the free space of the
+// volume gathers at its end. Directories are not moved.
+int b_compact (int kibPerSec, struct b_defrag_stats * stats);
+
 #endif
 
@@ -26,6 +26,15 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "fsLow.h"
 #include "mfs.h"
@@ -33,15 +42,39 @@
 #define DE_TYPE_UNUSED 		0
 #define DE_TYPE_DIRECTORY 	1
 #define DE_TYPE_FILE 		2
+#define DE_TYPE_INLINE		3	// data of the inline file in the entry before
 
-#define DE_NAME_MAXLEN 		20
+#define DE_IS_NAMED(type)	((type) == DE_TYPE_DIRECTORY || (type) == DE_TYPE_FILE)
 
-#define DIRMAX_ENTRIES		64
+#define DE_NAME_MAXLEN 		255
+
+// entries of a directory held in memory
+#define DIRMAX_ENTRIES		128
+
+// bytes of blocks allocated to a directory
+#define DIR_SIZE			4096
+
+// on-disk format, bumped whenever the layout of the volume changes
+#define FS_FORMAT_VERSION	5
+
+// largest cluster a volume can be formatted with: the records of a
+// directory block count their bytes in 16 bits
+#define FS_CLUSTER_MAX		(64 * 1024)
+
+// chains of deleted files waiting in the VCB for the reclaimer
+#define FS_ORPHAN_MAX		80
+
+// allocation groups, each of at least FS_GROUP_MIN_BLOCKS blocks
+#define FS_GROUP_MAX		16
+#define FS_GROUP_MIN_BLOCKS	1024
+
+// how long the reclaimer lets deletes gather before freeing them
+#define FS_RECLAIM_DELAY_MS	100
 
 typedef struct directoryEntry
 {
-	// string to hold name (limited to 20 characters)
-	char name[DE_NAME_MAXLEN];
+	// string to hold name (up to 255 characters)
+	char name[DE_NAME_MAXLEN + 1];
 
 	// type of directory:
 	// 0 is unused
@@ -53,6 +86,11 @@ typedef struct directoryEntry
 	uint64_t location;
 	uint64_t size;
 
+	// blocks of the map and of the whole chain of a sparse file, or of a
+	// file with blocks reserved past its end; 0 for any other file
+	uint32_t mapBlocks;
+	uint32_t allocBlocks;
+
 	// c time type to hold dates of creation, latest modification,
 	// latest viewing
 	time_t lastModified;
@@ -60,71 +98,62 @@ typedef struct directoryEntry
 	time_t dateCreated;
 } directoryEntry;
 
-#define CWDMAX_LEN	4096
-
-uint64_t allocateFreeBlocks(uint64_t numberOfBlocks);
-int writeBlock(void *buffer, uint64_t blockPosition);
-
-int initRootDirectory(uint64_t blockSize)
+// A file with location 0 has no blocks: its data (FS_INLINE_MAX bytes at
+// most) is kept in a DE_TYPE_INLINE entry right after its entry, which
+// overlays a directoryEntry
+typedef struct inlineDataEntry
 {
-	/* compute size of initial root directory */
-	const int initialNumberOfEntries = DIRMAX_ENTRIES;
-	uint64_t sizeRootDirectory = initialNumberOfEntries * sizeof(directoryEntry);
-	// fprintf(stderr, "Size of directoryEntry: %ld\n", sizeof(directoryEntry));
-
-	/* allocate memory for initializing root directory */
-	uint64_t numRootDirectoryBlocks = (sizeRootDirectory + blockSize - 1) / blockSize;
-	sizeRootDirectory = numRootDirectoryBlocks * blockSize;
-	directoryEntry * entries = calloc(numRootDirectoryBlocks, blockSize);
-
-
-	/* fill in entries in root directory */
-	for (int i = 0; i < initialNumberOfEntries; i++)
-	{
-		memset(entries[i].name, 0, sizeof(entries[i].name));
-		entries[i].type = DE_TYPE_UNUSED;
-		entries[i].location = 0;
-		entries[i].size = 0;
-		entries[i].lastModified = 0;
-		entries[i].lastOpened = 0;
-		entries[i].dateCreated = 0;
-	}
-
-	/* allocate blocks for storing root directory */
-	uint64_t nbrBlkOfRootDirectory = (sizeRootDirectory + blockSize - 1) / blockSize;
-	// fprintf(stderr, "Blocks allocated for root directory: %ld\n", nbrBlkOfRootDirectory);
-	uint64_t startBlock = allocateFreeBlocks(nbrBlkOfRootDirectory);
+	char data[DE_NAME_MAXLEN + 1];
+	int type;
+	uint64_t length;		// bytes of data
+} inlineDataEntry;
+
+_Static_assert(sizeof(inlineDataEntry) <= sizeof(directoryEntry)
+			   && offsetof(inlineDataEntry, type) == offsetof(directoryEntry, type),
+			   "inline entry must overlay a directory entry");
+_Static_assert(FS_INLINE_MAX <= sizeof(((inlineDataEntry *) 0)->data),
+			   "FS_INLINE_MAX must fit an inline entry");
+
+// On disk a directory is a sequence of variable-length records packed in
+// its blocks. A record never crosses a block and a record length of 0
+// ends the block. Entries in memory are decoded from the records; the
+// inline data of a file is stored in its record after the name.
+typedef struct __attribute__((packed)) dirRecord
+{
+	uint16_t recLen;		// bytes of this record, 0 ends the block
+	uint8_t type;
+	uint8_t nameLen;
+	uint8_t extra;			// inline data bytes of a file, blocks in use for "."
+	uint32_t location;
+	uint64_t size;
+	int64_t lastModified;
+	int64_t lastOpened;
+	int64_t dateCreated;
+	char name[];			// nameLen bytes, not terminated, then inline data
+} dirRecord;
 
-	/**
-	 * fill first and second entries
-	 */
+#define DE_RECORD_SIZE(nameLen, dataLen)	(sizeof(dirRecord) + (nameLen) + (dataLen))
 
-	/* 1st entry */
-	entries[0].name[0] = '.';
-	entries[0].type = DE_TYPE_DIRECTORY;
-	entries[0].location = startBlock;
-	entries[0].size = sizeRootDirectory;
-	entries[0].dateCreated = time(NULL);
-	entries[0].lastModified = entries[0].dateCreated;
-	entries[0].lastOpened = entries[0].dateCreated;
+// extra of a file recording its block counts, in a sparseRecord after the name
+#define DE_EXTRA_SPARSE		0xFF
 
-	/* 2nd entry has the same content as 1st except name is '..' */
-	memcpy(&entries[1], &entries[0], sizeof(directoryEntry));
-	entries[1].name[1] = '.';
+typedef struct __attribute__((packed)) sparseRecord
+{
+	uint32_t mapBlocks;
+	uint32_t allocBlocks;
+} sparseRecord;
 
-	/* write root directory to blocks */
-	char * buffer = (char *) entries;
-	for (int i = 0; i < nbrBlkOfRootDirectory; i++) {
-		writeBlock(buffer, startBlock+ i);
-		buffer += blockSize;
-	}
+_Static_assert(FS_INLINE_MAX < DE_EXTRA_SPARSE, "inline data length must not look sparse");
 
-	/* clean up */
-	free(entries);
+#define CWDMAX_LEN	4096
 
-	/* return startBlock of root entry */
-	return startBlock;
-}
+uint64_t allocateFreeBlocks(uint64_t numberOfBlocks);
+uint64_t allocateContiguousBlocks(uint64_t numberOfBlocks, uint64_t goal);
+void fs_count_lock_wait(void);
+uint64_t fs_free_blocks(void);
+int writeBlock(void *buffer, uint64_t blockPosition);
+void fs_dcache_release(void);
+void fs_hash_match_init(void);
 
 typedef struct vcb
 {
@@ -135,15 +164,109 @@ typedef struct vcb
 	// size of each block
 	int blockSize;
 	int numLBAPerBlock;
-	// number of free blocks available
+	// number of free blocks available, when the VCB was last written
 	int freeBlockCount;
 	// block number of first free block available
 	int nextFreeBlock;
 	// where root dir starts
 	int rootDirStart;
+	// layout of the volume, FS_FORMAT_VERSION
+	int formatVersion;
+	// start blocks of deleted chains not freed yet
+	int orphanCount;
+	uint32_t orphans[FS_ORPHAN_MAX];
+	// free blocks and cursor of each allocation group, written at unmount
+	// and good until the next mount clears cleanUnmount
+	int cleanUnmount;
+	int summaryGroups;
+	uint32_t groupFree[FS_GROUP_MAX];
+	uint32_t groupNext[FS_GROUP_MAX];
 } vcb;
 
 struct vcb fsVCB;
+struct fs_perfstats fsStats;
+
+// The volume is shared between threads. fsDirLock guards the directory
+// cache and the working directory: every directory function of mfs.h
+// holds it throughout, with FS_DIR_LOCK(). fsFATLock guards the VCB and
+// the orphans, and is held to lock the FAT as a whole; the lock of each
+// allocation group guards its part of the FAT. Locks are taken in that
+// order, then fsStatsLock, fsIOLock or fsReclaimLock.
+pthread_mutex_t fsDirLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_mutex_t fsFATLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_mutex_t fsIOLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t fsStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void fs_dir_unlock(int *held)
+{
+	pthread_mutex_unlock(&fsDirLock);
+}
+
+// hold fsDirLock until the end of the enclosing block
+#define FS_DIR_LOCK() \
+	int fsDirHeld __attribute__((cleanup(fs_dir_unlock))) = pthread_mutex_lock(&fsDirLock)
+
+// second descriptor of the volume file, for block I/O at an offset and
+// for discard. fsLow seeks and reads in separate calls: without this
+// descriptor its calls are serialized by fsIOLock.
+int fsVolumeFd = -1;
+
+// LBA following the last data block read or written, to measure seek
+// distances. The VCB and FAT in front of the data are left out, as they
+// are small enough to be cached whole.
+uint64_t fsNextLBA = 0;
+uint64_t fsDataFirst;				// first data block
+
+void fs_lba_account(uint64_t lbaCount, uint64_t lbaPosition, int write)
+{
+	pthread_mutex_lock(&fsStatsLock);
+	if (lbaPosition < fsDataFirst * fsVCB.numLBAPerBlock) {
+		fsStats.fatBlockWrites += (write && lbaPosition > 0);
+		pthread_mutex_unlock(&fsStatsLock);
+		return;
+	}
+	fsStats.ioCalls++;
+	fsStats.seekLBAs += (lbaPosition > fsNextLBA) ? lbaPosition - fsNextLBA
+												  : fsNextLBA - lbaPosition;
+	fsNextLBA = lbaPosition + lbaCount;
+	pthread_mutex_unlock(&fsStatsLock);
+}
+
+void fs_count_lock_wait(void)
+{
+	pthread_mutex_lock(&fsStatsLock);
+	fsStats.allocLockWaits++;
+	pthread_mutex_unlock(&fsStatsLock);
+}
+
+uint64_t fs_lba_read(void *buffer, uint64_t lbaCount, uint64_t lbaPosition)
+{
+	fs_lba_account(lbaCount, lbaPosition, 0);
+	if (fsVolumeFd >= 0) {
+		// the partition header of fsLow comes before LBA 0
+		ssize_t n = pread(fsVolumeFd, buffer, lbaCount * MINBLOCKSIZE,
+						  (lbaPosition + 1) * MINBLOCKSIZE);
+		return (n < 0) ? 0 : n / MINBLOCKSIZE;
+	}
+	pthread_mutex_lock(&fsIOLock);
+	uint64_t ret = LBAread(buffer, lbaCount, lbaPosition);
+	pthread_mutex_unlock(&fsIOLock);
+	return ret;
+}
+
+uint64_t fs_lba_write(void *buffer, uint64_t lbaCount, uint64_t lbaPosition)
+{
+	fs_lba_account(lbaCount, lbaPosition, 1);
+	if (fsVolumeFd >= 0) {
+		ssize_t n = pwrite(fsVolumeFd, buffer, lbaCount * MINBLOCKSIZE,
+						   (lbaPosition + 1) * MINBLOCKSIZE);
+		return (n < 0) ? 0 : n / MINBLOCKSIZE;
+	}
+	pthread_mutex_lock(&fsIOLock);
+	uint64_t ret = LBAwrite(buffer, lbaCount, lbaPosition);
+	pthread_mutex_unlock(&fsIOLock);
+	return ret;
+}
 
 void writeVCB(void)
 {
@@ -153,1063 +276,3939 @@ void writeVCB(void)
 	}
 
 	char *buffer = calloc(1, MINBLOCKSIZE);
+	pthread_mutex_lock(&fsFATLock);
+	fsVCB.freeBlockCount = fs_free_blocks();
 	memcpy(buffer, &fsVCB, sizeof(struct vcb));
-	LBAwrite(buffer, 1, 0);
+	fs_lba_write(buffer, 1, 0);
+	pthread_mutex_unlock(&fsFATLock);
 	free(buffer);
 }
 
 int readBlock(void *buffer, uint blockPosition)
 {
-	return LBAread(buffer, fsVCB.numLBAPerBlock, blockPosition * fsVCB.numLBAPerBlock);
+	return fs_lba_read(buffer, fsVCB.numLBAPerBlock, blockPosition * fsVCB.numLBAPerBlock);
 }
 
 int writeBlock(void *buffer, uint64_t blockPosition)
 {
-	return LBAwrite(buffer, fsVCB.numLBAPerBlock, blockPosition * fsVCB.numLBAPerBlock);
+	return fs_lba_write(buffer, fsVCB.numLBAPerBlock, blockPosition * fsVCB.numLBAPerBlock);
 }
 
-uint32_t *bufFAT = NULL;
-int posBufFAT = -1;
+uint64_t fs_block_read(void *buffer, uint64_t blockCount, uint64_t blockPosition)
+{
+	return fs_lba_read(buffer, blockCount * fsVCB.numLBAPerBlock,
+					   blockPosition * fsVCB.numLBAPerBlock) / fsVCB.numLBAPerBlock;
+}
 
-uint32_t getFATEntry(int blockNumber)
+uint64_t fs_block_write(void *buffer, uint64_t blockCount, uint64_t blockPosition)
 {
-	// compute byte offset of FAT entry
-	int offsetEntry = blockNumber * 4;
+	return fs_lba_write(buffer, blockCount * fsVCB.numLBAPerBlock,
+						blockPosition * fsVCB.numLBAPerBlock) / fsVCB.numLBAPerBlock;
+}
 
-	// FAT starts from the second block
-	int position = offsetEntry / fsVCB.blockSize + 1;
+uint64_t fs_lba_block(uint64_t lbaPosition)
+{
+	return lbaPosition / fsVCB.numLBAPerBlock;
+}
 
-	// allocate buffer (if not allocated yet)
-	if (bufFAT == NULL) {
-		bufFAT = malloc(fsVCB.blockSize);
-		memset(bufFAT, 0, fsVCB.blockSize);
-	}
+// encode entry as a record at p followed by dataLen bytes of inline data,
+// returns the length of the record
+int fs_record_encode(char *p, directoryEntry *entry, const char *data,
+					 int dataLen, int extra)
+{
+	dirRecord *record = (dirRecord *) p;
+	size_t nameLen = strlen(entry->name);
+	record->recLen = DE_RECORD_SIZE(nameLen, dataLen);
+	record->type = entry->type;
+	record->nameLen = nameLen;
+	record->extra = extra;
+	record->location = entry->location;
+	record->size = entry->size;
+	record->lastModified = entry->lastModified;
+	record->lastOpened = entry->lastOpened;
+	record->dateCreated = entry->dateCreated;
+	memcpy(record->name, entry->name, nameLen);
+	memcpy(record->name + nameLen, data, dataLen);
+	return record->recLen;
+}
+
+// decode the records of a block into at most max entries, an inline
+// entry following each file with inline data. Stores the blocks in use
+// if the block holds ".". Returns the number of entries.
+int fs_block_decode(const char *block, directoryEntry *entries, int max,
+					int *blocksUsed)
+{
+	int n = 0;
+	int pos = 0;
+	while (pos + sizeof(dirRecord) <= fsVCB.blockSize && n < max) {
+		const dirRecord *record = (const dirRecord *) (block + pos);
+		if (record->recLen == 0) {
+			break;
+		}
 
-	// read LBA if not buffered
-	if (posBufFAT != position) {
-		readBlock(bufFAT, position);
-		posBufFAT = position;
+		directoryEntry *entry = &entries[n++];
+		memset(entry, 0, sizeof(directoryEntry));
+		memcpy(entry->name, record->name, record->nameLen);
+		entry->type = record->type;
+		entry->location = record->location;
+		entry->size = record->size;
+		entry->lastModified = record->lastModified;
+		entry->lastOpened = record->lastOpened;
+		entry->dateCreated = record->dateCreated;
+
+		if (record->type == DE_TYPE_FILE && record->extra == DE_EXTRA_SPARSE) {
+			sparseRecord sparse;
+			memcpy(&sparse, record->name + record->nameLen, sizeof(sparseRecord));
+			entry->mapBlocks = sparse.mapBlocks;
+			entry->allocBlocks = sparse.allocBlocks;
+		}
+		else if (record->type == DE_TYPE_FILE && record->extra > 0 && n < max) {
+			inlineDataEntry *data = (inlineDataEntry *) &entries[n++];
+			memset(data, 0, sizeof(directoryEntry));
+			data->type = DE_TYPE_INLINE;
+			data->length = record->extra;
+			memcpy(data->data, record->name + record->nameLen, record->extra);
+		}
+		else if (record->type == DE_TYPE_DIRECTORY && strcmp(entry->name, ".") == 0
+				 && blocksUsed != NULL) {
+			*blocksUsed = record->extra;
+		}
+		pos += record->recLen;
 	}
+	return n;
+}
 
-	offsetEntry -= (position - 1) * fsVCB.blockSize;
-	return bufFAT[offsetEntry / 4];
+// write the first block of a new directory at startBlock, holding only
+// "." and "..". The other blocks are not read until records are put there.
+void fs_dir_write_new(uint64_t startBlock, uint64_t parentBlock)
+{
+	directoryEntry entry;
+	memset(&entry, 0, sizeof(directoryEntry));
+	entry.type = DE_TYPE_DIRECTORY;
+	entry.location = startBlock;
+	entry.size = DIR_SIZE;
+	entry.dateCreated = time(NULL);
+	entry.lastModified = entry.dateCreated;
+	entry.lastOpened = entry.dateCreated;
+
+	char *buffer = calloc(1, fsVCB.blockSize);
+	int pos = 0;
+
+	// "." records the blocks in use
+	strcpy(entry.name, ".");
+	pos += fs_record_encode(buffer + pos, &entry, NULL, 0, 1);
+
+	// ".." points to parent location
+	strcpy(entry.name, "..");
+	entry.location = parentBlock;
+	pos += fs_record_encode(buffer + pos, &entry, NULL, 0, 0);
+
+	writeBlock(buffer, startBlock);
+	free(buffer);
 }
 
-void setFATEntry(int blockNumber, uint32_t val)
+int initRootDirectory(uint64_t blockSize)
 {
-	// compute byte offset of FAT ENTRY
-	int offsetEntry = blockNumber * 4;
+	/* allocate blocks for storing root directory */
+	uint64_t nbrBlkOfRootDirectory = (DIR_SIZE + blockSize - 1) / blockSize;
+	uint64_t startBlock = allocateContiguousBlocks(nbrBlkOfRootDirectory, 0);
 
-	// FAT starts from the second block
-	int position = offsetEntry / fsVCB.blockSize + 1;
+	/* parent of root is root itself */
+	fs_dir_write_new(startBlock, startBlock);
+
+	/* return startBlock of root entry */
+	return startBlock;
+}
+
+//
+// Allocation groups
+//
+// The blocks of the volume are split into groups of consecutive blocks,
+// sized so that the entries of a group fill whole FAT blocks. Each group
+// has its own lock, count of free blocks, cursor and FAT buffer, so that
+// threads allocating in different groups do not wait for each other.
+//
+// A new directory goes to the group with the most free blocks, and the
+// blocks of a file are taken in the group of its directory, so that the
+// blocks of a directory tree stay close together. When that group is in
+// use by another thread, a thread takes blocks from a group of its own,
+// and from the others only once that one is full.
+//
 
-	// allocate buffer (if not allocated yet)
-	if (bufFAT == NULL) {
-		bufFAT = malloc(fsVCB.blockSize);
-		memset(bufFAT, 0, fsVCB.blockSize);
+typedef struct fsGroup
+{
+	pthread_mutex_t lock;	// guards the rest and the FAT entries of the group
+	uint64_t start;			// blocks start .. end - 1
+	uint64_t end;
+	int64_t free;			// free blocks
+	uint64_t next;			// no free block of the group before it
+	uint32_t *fatBuffer;	// FAT block last read or written
+	int fatPosition;
+} fsGroup;
+
+fsGroup fsGroups[FS_GROUP_MAX];
+int fsGroupCount = 0;
+uint64_t fsGroupBlocks;			// blocks in each group
+int fsAllocMode = FS_ALLOC_GROUPS;
+__thread int fsThreadGroup = -1;	// group of the calling thread, once it allocated
+int fsThreadGroupsGiven = 0;
+
+fsGroup *fs_group_of(uint64_t block)
+{
+	uint64_t g = block / fsGroupBlocks;
+	return &fsGroups[(g < fsGroupCount) ? g : fsGroupCount - 1];
+}
+
+// lock grp, counting the times another thread held it
+void fs_group_lock(fsGroup *grp)
+{
+	if (pthread_mutex_trylock(&grp->lock) != 0) {
+		fs_count_lock_wait();
+		pthread_mutex_lock(&grp->lock);
 	}
-	// read LBA if not buffered
-	if (posBufFAT != position) {
-		readBlock(bufFAT, position);
-		posBufFAT = position;
+}
+
+// FAT entry of block, in the buffer of its group which the caller holds.
+// Loading another FAT block drops changes to the buffer not written yet.
+uint32_t *fs_group_entry(fsGroup *grp, uint64_t block)
+{
+	uint32_t perBlock = fsVCB.blockSize / 4;
+
+	// FAT starts from the second block
+	int position = block / perBlock + 1;
+	if (grp->fatPosition != position) {
+		readBlock(grp->fatBuffer, position);
+		grp->fatPosition = position;
 	}
+	return &grp->fatBuffer[block % perBlock];
+}
 
-	offsetEntry -= (position - 1) * fsVCB.blockSize;
-	bufFAT[offsetEntry / 4] = val;
-	writeBlock(bufFAT, position);
+void fs_group_entry_write(fsGroup *grp)
+{
+	writeBlock(grp->fatBuffer, grp->fatPosition);
 }
 
-uint64_t allocateFreeBlocks(uint64_t numberOfBlock)
+// split the volume described by fsVCB into groups, before any use of the
+// FAT
+void fs_groups_layout(void)
 {
-	uint64_t allocatedBlocks = 0;
+	static int locksReady = 0;
+	if (!locksReady) {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		for (int g = 0; g < FS_GROUP_MAX; g++) {
+			pthread_mutex_init(&fsGroups[g].lock, &attr);
+		}
+		pthread_mutexattr_destroy(&attr);
+		locksReady = 1;
+	}
 
-	uint64_t startBlock = fsVCB.nextFreeBlock;
-	allocatedBlocks++;
-	if (getFATEntry(startBlock) != 0) {
-		fprintf(stderr, "ERROR(%s): incorrect nextFreeBlock\n", __func__);
-		exit(1);
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	fsDataFirst = 1 + (fsVCB.numBlocks * 4 + fsVCB.blockSize - 1) / fsVCB.blockSize;
+	int count = fsVCB.numBlocks / FS_GROUP_MIN_BLOCKS;
+	if (count > FS_GROUP_MAX) {
+		count = FS_GROUP_MAX;
+	}
+	if (count < 1) {
+		count = 1;
+	}
+	fsGroupBlocks = (fsVCB.numBlocks + count - 1) / count;
+	fsGroupBlocks = (fsGroupBlocks + perBlock - 1) / perBlock * perBlock;
+	count = (fsVCB.numBlocks + fsGroupBlocks - 1) / fsGroupBlocks;
+
+	for (int g = 0; g < count; g++) {
+		fsGroup *grp = &fsGroups[g];
+		grp->start = g * fsGroupBlocks;
+		grp->end = grp->start + fsGroupBlocks;
+		if (grp->end > fsVCB.numBlocks) {
+			grp->end = fsVCB.numBlocks;
+		}
+		grp->free = 0;
+		grp->next = (grp->start < fsDataFirst) ? fsDataFirst : grp->start;
+		grp->fatBuffer = realloc(grp->fatBuffer, fsVCB.blockSize);
+		grp->fatPosition = -1;
 	}
+	fsGroupCount = count;
+}
 
-	uint64_t currBlock = startBlock;
-	uint64_t nextBlock = currBlock + 1;
-	while (allocatedBlocks < numberOfBlock) {
-		// find next free block
-		while (getFATEntry(nextBlock) != 0) {
-			nextBlock++;
+// FAT blocks read with each call by the scan of the groups, and most
+// threads it runs in
+#define FS_SCAN_BLOCKS		64
+#define FS_SCAN_THREADS_MAX	8
+
+int fsScanThreads = 1;
+
+// count the free blocks of grp and find its first free one, reading its
+// part of the FAT FS_SCAN_BLOCKS blocks at a time into buffer
+void fs_group_scan(fsGroup *grp, uint32_t *buffer)
+{
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	uint64_t fatEnd = (grp->end + perBlock - 1) / perBlock;
+	int64_t free = 0;
+	uint64_t next = grp->end;
+
+	for (uint64_t b = grp->start / perBlock; b < fatEnd; b += FS_SCAN_BLOCKS) {
+		uint64_t n = fatEnd - b;
+		if (n > FS_SCAN_BLOCKS) {
+			n = FS_SCAN_BLOCKS;
 		}
-		if (nextBlock == 0xFFFFFFFF) {
-			fprintf(stderr, "ERROR(%s): no free space\n", __func__);
-			exit(1);
+		// FAT starts from the second block
+		fs_lba_read(buffer, n * fsVCB.numLBAPerBlock, (b + 1) * fsVCB.numLBAPerBlock);
+		for (uint64_t j = 0; j < n * perBlock && b * perBlock + j < grp->end; j++) {
+			if (buffer[j] == 0) {
+				free++;
+				if (next == grp->end) {
+					next = b * perBlock + j;
+				}
+			}
 		}
+	}
 
-		// chain next block to current block
-		setFATEntry(currBlock, nextBlock);
+	pthread_mutex_lock(&grp->lock);
+	grp->free = free;
+	grp->next = next;
+	pthread_mutex_unlock(&grp->lock);
+}
 
-		// update for further finding
-		currBlock = nextBlock;
-		nextBlock = currBlock + 1;
-		allocatedBlocks++;
+// scan groups first, first + fsScanThreads ...
+void *fs_groups_scanner(void *arg)
+{
+	uint32_t *buffer = malloc(FS_SCAN_BLOCKS * fsVCB.blockSize);
+	for (int g = (intptr_t) arg; g < fsGroupCount; g += fsScanThreads) {
+		fs_group_scan(&fsGroups[g], buffer);
 	}
+	free(buffer);
+	return NULL;
+}
 
-	// mark end of chain
-	setFATEntry(currBlock, 0xFFFFFFFF);
+// count the free blocks of every group from the FAT, the groups shared
+// out between threads
+void fs_groups_count(void)
+{
+	pthread_t scanners[FS_SCAN_THREADS_MAX];
 
-	// find next free block
-	nextBlock = currBlock + 1;
-	while (getFATEntry(nextBlock) != 0) {
-		nextBlock++;
+	fsScanThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (fsScanThreads > FS_SCAN_THREADS_MAX) {
+		fsScanThreads = FS_SCAN_THREADS_MAX;
 	}
-	if (nextBlock == 0xFFFFFFFF) {
-		fprintf(stderr, "ERROR(%s): no free space\n", __func__);
-		exit(1);
+	if (fsScanThreads > fsGroupCount) {
+		fsScanThreads = fsGroupCount;
 	}
-	fsVCB.nextFreeBlock = nextBlock;
-	writeVCB();
-
-	if (startBlock == 0) {
-		fprintf(stderr, "ERROR: allocated blocks shall not start from position 0\n");
-		exit(1);
+	if (fsScanThreads < 1) {
+		fsScanThreads = 1;
+	}
+	for (int t = 1; t < fsScanThreads; t++) {
+		pthread_create(&scanners[t], NULL, fs_groups_scanner, (void *) (intptr_t) t);
+	}
+	fs_groups_scanner((void *) 0);
+	for (int t = 1; t < fsScanThreads; t++) {
+		pthread_join(scanners[t], NULL);
 	}
-	return startBlock;
 }
 
-void freeAllocatedBlocks(uint64_t startBlock)
+// take the free blocks of every group from the summary written at the last
+// unmount, if it was clean; 0 if there is none
+int fs_groups_load_summary(void)
 {
-	if (startBlock == 0) {
-		fprintf(stderr, "ERROR(%s): startBlock shall not be 0\n", __func__);
-		return;
-	}
-
-	uint64_t currentBlock = startBlock;
-	uint64_t nextBlock = getFATEntry(currentBlock);
-	while (nextBlock != 0xFFFFFFFF) {
-		setFATEntry(currentBlock, 0);
-		currentBlock = nextBlock;
-		nextBlock = getFATEntry(currentBlock);
+	if (!fsVCB.cleanUnmount || fsVCB.summaryGroups != fsGroupCount) {
+		return 0;
 	}
-	setFATEntry(currentBlock, 0);
-
-	// update nextFreeBlock in VCB
-	if (startBlock < fsVCB.nextFreeBlock) {
-		fsVCB.nextFreeBlock = startBlock;
-		writeVCB();
+	for (int g = 0; g < fsGroupCount; g++) {
+		fsGroups[g].free = fsVCB.groupFree[g];
+		fsGroups[g].next = fsVCB.groupNext[g];
 	}
+	return 1;
 }
 
-fat_file_blockinfo * fat_get_file_blockinfo(int startBlockNumber)
+// keep the free blocks of every group in the VCB for the next mount
+void fs_groups_save_summary(void)
 {
-	uint32_t nextBlock = getFATEntry(startBlockNumber);
-	if (nextBlock == 0) {
-		fprintf(stderr, "ERROR(%s): not an allocated FAT entry\n", __func__);
-		return NULL;
+	for (int g = 0; g < fsGroupCount; g++) {
+		pthread_mutex_lock(&fsGroups[g].lock);
+		fsVCB.groupFree[g] = fsGroups[g].free;
+		fsVCB.groupNext[g] = fsGroups[g].next;
+		pthread_mutex_unlock(&fsGroups[g].lock);
 	}
+	fsVCB.summaryGroups = fsGroupCount;
+}
 
-	fat_file_blockinfo * bi = calloc(1, sizeof(fat_file_blockinfo));
-	bi->block_size = fsVCB.blockSize;
-	bi->table_blocknumbers = calloc(1, sizeof(int));
-	bi->table_blocknumbers[0] = startBlockNumber;
-	bi->total_blocks = 1;
-
-	while (nextBlock != 0xFFFFFFFF) {
-		bi->table_blocknumbers = reallocarray(bi->table_blocknumbers, 
-											  bi->total_blocks + 1,
-											  sizeof(int));
-		bi->table_blocknumbers[bi->total_blocks] = nextBlock;
-        bi->total_blocks++;
-
-		nextBlock = getFATEntry(nextBlock);
+// free blocks of all groups
+uint64_t fs_free_blocks(void)
+{
+	int64_t count = 0;
+	for (int g = 0; g < fsGroupCount; g++) {
+		pthread_mutex_lock(&fsGroups[g].lock);
+		count += fsGroups[g].free;
+		pthread_mutex_unlock(&fsGroups[g].lock);
 	}
-
-	return bi;
+	return count;
 }
 
-int fat_add_block(fat_file_blockinfo *bi)
+void fs_groups_release(void)
 {
-	uint32_t newBlock = allocateFreeBlocks(1);
-	bi->table_blocknumbers = reallocarray(bi->table_blocknumbers,
-	                                      bi->total_blocks + 1,
-										  sizeof(int));
-	bi->table_blocknumbers[bi->total_blocks] = newBlock;
-	if (bi->total_blocks > 0) {
-		setFATEntry(bi->table_blocknumbers[bi->total_blocks - 1], newBlock);
+	for (int g = 0; g < fsGroupCount; g++) {
+		free(fsGroups[g].fatBuffer);
+		fsGroups[g].fatBuffer = NULL;
 	}
-	bi->total_blocks++;
-	return 0;
+	fsGroupCount = 0;
 }
 
-// int returned is block number where dir starts
-int initDirectory(directoryEntry *parent)
+uint32_t getFATEntry(int blockNumber)
 {
-	// if NULL is passed in then its init the root dir
-	// malloc mem to hold DE arr
-	// allocate blocks to hold DE arr
-	// init each DE to a known state (avail)
-	// init . dir
-	// init .. dir
-	// LBAwrite all blocks of root dir
-	// free alloc'd mem
-	// return block num for start of dir
-	return 1;
+	fsGroup *grp = fs_group_of(blockNumber);
+	pthread_mutex_lock(&grp->lock);
+	uint32_t val = *fs_group_entry(grp, blockNumber);
+	pthread_mutex_unlock(&grp->lock);
+	return val;
 }
 
-int initFileSystem(uint64_t numberOfBlocks, uint64_t blockSize)
+void setFATEntry(int blockNumber, uint32_t val)
 {
-	printf("Initializing File System with %ld blocks with a block size of %ld\n", numberOfBlocks, blockSize);
-	/* TODO: Add any code you need to initialize your file system. */
-
-	struct vcb *buffer = malloc(MINBLOCKSIZE);
-
-	// read the first block to check the signature.
-	LBAread(buffer, 1, 0);
-
-	// if it does not match, vcb needs to be formatted
-	if (buffer->sig != 0x4E415445)
-	{
-		printf("No valid VCB, need to format filesystem\n");
-
-		// initialize VCB volume data
-		fsVCB.numBlocks = numberOfBlocks;
-		fsVCB.blockSize = blockSize;
-		fsVCB.numLBAPerBlock = blockSize / MINBLOCKSIZE;
-		fsVCB.sig = 0x4E415445;
+	fsGroup *grp = fs_group_of(blockNumber);
+	pthread_mutex_lock(&grp->lock);
+	uint32_t *entry = fs_group_entry(grp, blockNumber);
+	if (*entry == 0 && val != 0) {
+		grp->free--;
+	}
+	else if (*entry != 0 && val == 0) {
+		grp->free++;
+		if (blockNumber < grp->next) {
+			grp->next = blockNumber;
+		}
+	}
+	*entry = val;
+	fs_group_entry_write(grp);
+	pthread_mutex_unlock(&grp->lock);
+}
 
-		// initialize the FAT
-		// number of blocks required for size of table
-		uint64_t numBlocksFAT = ((numberOfBlocks * 4) + (blockSize - 1)) / blockSize;
-		char * FATBuffer = malloc(blockSize);
-		memset(FATBuffer, 0x00, blockSize);
+void reclaimOrphans(void);
+uint64_t freeAllocatedChains(const uint64_t *heads, int count);
 
-		for (int i = 1; i < numBlocksFAT; i++) {
-			// at initialization, FAT is completely free
-			writeBlock(FATBuffer, i);
+// first free block from block on; when the volume is full the chains of
+// deleted files still waiting for the reclaimer are freed right away.
+// Returns 0 if there is no free block left.
+uint64_t findFreeBlock(uint64_t block)
+{
+	while (1) {
+		while (block < fsVCB.numBlocks && getFATEntry(block) != 0) {
+			block++;
 		}
-		free(FATBuffer);
-		FATBuffer = NULL;
-
-		// Mark the already  used blocks
-		// 		block 0: VCB
-		// 		block 1 ~ (numBlocksFAT - 1): FAT
-		for (int i = 0; i < numBlocksFAT; i++) {
-			setFATEntry(i, 0xFFFFFFFF);
+		if (block < fsVCB.numBlocks) {
+			return block;
 		}
+		if (fsVCB.orphanCount == 0) {
+			return 0;
+		}
+		reclaimOrphans();
+		block = fsVCB.nextFreeBlock;
+	}
+}
 
-		fsVCB.freeBlockCount = fsVCB.numBlocks;
-		fsVCB.freeBlockCount -= 1; // VCB
-		fsVCB.freeBlockCount -= numBlocksFAT; // FAT
-
-		fsVCB.nextFreeBlock = numBlocksFAT;
-
-		// initialize the root directory
-		fsVCB.rootDirStart = initRootDirectory(blockSize);
-		
-		// finish formatting by writing VCB to block 0
-		memset(buffer, 0, MINBLOCKSIZE);
-		memcpy(buffer, &fsVCB, sizeof(struct vcb));
-		LBAwrite(buffer, 1, 0);
+// whether count blocks are free, once the chains of deleted files are
+// freed if need be
+int fs_have_free_blocks(uint64_t count)
+{
+	if (fs_free_blocks() >= count) {
+		return 1;
 	}
-	else 
-	{
-		memcpy(&fsVCB, buffer, sizeof(struct vcb));
+	pthread_mutex_lock(&fsFATLock);
+	if (fsVCB.orphanCount > 0) {
+		reclaimOrphans();
 	}
-	free(buffer);
+	pthread_mutex_unlock(&fsFATLock);
+	return fs_free_blocks() >= count;
+}
 
-	fs_setcwd("/");
-	return 0;
+// lock every group, in order, so that the FAT can be scanned and
+// changed as a whole. The caller holds fsFATLock.
+void fs_groups_lock_all(void)
+{
+	for (int g = 0; g < fsGroupCount; g++) {
+		fs_group_lock(&fsGroups[g]);
+	}
 }
 
-void exitFileSystem()
+void fs_groups_unlock_all(void)
 {
-	printf("System exiting\n");
+	for (int g = fsGroupCount - 1; g >= 0; g--) {
+		pthread_mutex_unlock(&fsGroups[g].lock);
+	}
+}
 
-	// free buffer for FAT
-	if (bufFAT != NULL) {
-		free(bufFAT);
-		bufFAT = NULL;
-		posBufFAT = -1;
+// group the calling thread allocates from when the group it aims at is
+// in use: threads get groups in turn
+int fs_thread_group(void)
+{
+	if (fsThreadGroup < 0) {
+		pthread_mutex_lock(&fsFATLock);
+		fsThreadGroup = fsThreadGroupsGiven++;
+		pthread_mutex_unlock(&fsFATLock);
 	}
+	return fsThreadGroup % fsGroupCount;
 }
 
-//
-// Filesystem interfaces
-//
+// group to try at attempt 0 .. fsGroupCount of an allocation aiming at
+// goalGroup: the goal's group if no other thread is in it, then the
+// thread's own group, then every other. Returns it locked, or NULL.
+fsGroup *fs_group_attempt(fsGroup *goalGroup, int attempt)
+{
+	if (attempt == 0) {
+		if (pthread_mutex_trylock(&goalGroup->lock) != 0) {
+			fs_count_lock_wait();
+			return NULL;
+		}
+		return goalGroup;
+	}
+	fsGroup *grp = &fsGroups[(fs_thread_group() + attempt - 1) % fsGroupCount];
+	fs_group_lock(grp);
+	return grp;
+}
+
+// take up to count free blocks of grp, which the caller holds, the first
+// from block from on, and chain them. Returns how many were taken, the
+// first in *head and the last, which ends the chain, in *tail.
+uint64_t fs_group_take(fsGroup *grp, uint64_t from, uint64_t count,
+					   uint32_t *head, uint32_t *tail)
+{
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	uint32_t *taken = malloc(count * sizeof(uint32_t));
+	uint64_t n = 0;
+
+	// from goal to the end of the group, then from its first free block
+	if (from < grp->next || from >= grp->end) {
+		from = grp->next;
+	}
+	for (int pass = 0; pass < 2 && n < count; pass++) {
+		uint64_t first = (pass == 0) ? from : grp->next;
+		uint64_t end = (pass == 0) ? grp->end : from;
+		uint64_t block = first;
+		for (; block < end && n < count && n < grp->free; block++) {
+			if (*fs_group_entry(grp, block) == 0) {
+				taken[n++] = block;
+			}
+		}
+		if (first == grp->next) {
+			// every block before is in use or taken now
+			grp->next = block;
+		}
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		if (i > 0 && taken[i] / perBlock != taken[i - 1] / perBlock) {
+			fs_group_entry_write(grp);
+		}
+		*fs_group_entry(grp, taken[i]) = (i + 1 < n) ? taken[i + 1] : 0xFFFFFFFF;
+	}
+	if (n > 0) {
+		fs_group_entry_write(grp);
+		grp->free -= n;
+		*head = taken[0];
+		*tail = taken[n - 1];
+	}
+	free(taken);
+	return n;
+}
+
+// allocate count blocks from the groups, chained, the first free from
+// goal on. Returns 0, with nothing allocated, if there are not so many.
+uint64_t fs_groups_allocate(uint64_t count, uint64_t goal)
+{
+	fsGroup *goalGroup = fs_group_of(goal);
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	uint64_t got = 0;
+
+	if (!fs_have_free_blocks(count)) {
+		return 0;
+	}
+	for (int attempt = 0; got < count; attempt++) {
+		if (attempt > fsGroupCount) {
+			// every group is full: free the chains of deleted files now
+			pthread_mutex_lock(&fsFATLock);
+			int orphans = fsVCB.orphanCount;
+			if (orphans > 0) {
+				reclaimOrphans();
+			}
+			pthread_mutex_unlock(&fsFATLock);
+			if (orphans == 0) {
+				// other threads took the rest: give back what was taken
+				if (head != 0) {
+					uint64_t taken = head;
+					freeAllocatedChains(&taken, 1);
+				}
+				return 0;
+			}
+			attempt = 0;
+		}
+
+		fsGroup *grp = fs_group_attempt(goalGroup, attempt);
+		if (grp == NULL) {
+			continue;
+		}
+		uint32_t segHead, segTail;
+		uint64_t n = fs_group_take(grp, (grp == goalGroup) ? goal : 0,
+								   count - got, &segHead, &segTail);
+		pthread_mutex_unlock(&grp->lock);
+		if (n == 0) {
+			continue;
+		}
+
+		// link the blocks of this group after those taken before, with
+		// no two groups held at once
+		if (tail != 0) {
+			setFATEntry(tail, segHead);
+		}
+		else {
+			head = segHead;
+		}
+		tail = segTail;
+		got += n;
+	}
+	return head;
+}
+
+// allocate numberOfBlock blocks, chained. With a goal they come from the
+// allocation groups, the first free from goal on; a goal of 0 takes them
+// from nextFreeBlock on, with the whole FAT locked. Returns 0, with
+// nothing allocated, if there are not so many free blocks.
+uint64_t allocateFreeBlocksNear(uint64_t numberOfBlock, uint64_t goal)
+{
+	if (goal != 0) {
+		return fs_groups_allocate(numberOfBlock, goal);
+	}
+
+	uint64_t allocatedBlocks = 0;
+
+	pthread_mutex_lock(&fsFATLock);
+	fs_groups_lock_all();
+	if (!fs_have_free_blocks(numberOfBlock)) {
+		fs_groups_unlock_all();
+		pthread_mutex_unlock(&fsFATLock);
+		return 0;
+	}
+	// allocations from the groups leave nextFreeBlock behind
+	uint64_t startBlock = findFreeBlock(fsVCB.nextFreeBlock);
+	allocatedBlocks++;
+
+	uint64_t currBlock = startBlock;
+	uint64_t nextBlock = currBlock + 1;
+	while (allocatedBlocks < numberOfBlock) {
+		// find next free block
+		nextBlock = findFreeBlock(nextBlock);
+
+		// chain next block to current block
+		setFATEntry(currBlock, nextBlock);
+
+		// update for further finding
+		currBlock = nextBlock;
+		nextBlock = currBlock + 1;
+		allocatedBlocks++;
+	}
+
+	// mark end of chain
+	setFATEntry(currBlock, 0xFFFFFFFF);
+
+	// find next free block, the start of the volume if none is left
+	if (getFATEntry(fsVCB.nextFreeBlock) != 0) {
+		fsVCB.nextFreeBlock = findFreeBlock(fsVCB.nextFreeBlock);
+		writeVCB();
+	}
+	fs_groups_unlock_all();
+	pthread_mutex_unlock(&fsFATLock);
+	return startBlock;
+}
+
+uint64_t allocateFreeBlocks(uint64_t numberOfBlock)
+{
+	return allocateFreeBlocksNear(numberOfBlock, 0);
+}
+
+// chain free blocks start .. start + count - 1 in order, writing each FAT
+// block they have entries in once
+void setFATRun(uint64_t start, uint64_t count)
+{
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	uint64_t block = start;
+	uint64_t end = start + count;
+
+	while (block < end) {
+		fsGroup *grp = fs_group_of(block);
+		pthread_mutex_lock(&grp->lock);
+		uint32_t *entries = fs_group_entry(grp, block) - block % perBlock;
+		uint64_t fatEnd = (block / perBlock + 1) * perBlock;
+		for (; block < end && block < fatEnd; block++) {
+			entries[block % perBlock] = (block + 1 < end) ? block + 1 : 0xFFFFFFFF;
+			grp->free--;
+		}
+		fs_group_entry_write(grp);
+		pthread_mutex_unlock(&grp->lock);
+	}
+}
+
+// first of count free blocks in a row in grp, which the caller holds,
+// looking from block from on and then from its first free block; 0 if
+// there are none
+uint64_t fs_group_find_run(fsGroup *grp, uint64_t from, uint64_t count)
+{
+	if (from < grp->next || from >= grp->end) {
+		from = grp->next;
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t block = (pass == 0) ? from : grp->next;
+		uint64_t end = (pass == 0) ? grp->end : from + count;
+		if (end > grp->end) {
+			end = grp->end;
+		}
+		uint64_t run = 0;
+		for (; block < end; block++) {
+			run = (*fs_group_entry(grp, block) == 0) ? run + 1 : 0;
+			if (run == count) {
+				return block + 1 - run;
+			}
+		}
+	}
+	return 0;
+}
+
+// allocate count consecutive blocks within one group, the goal's group
+// first. Returns 0 if no group has such a run.
+uint64_t fs_groups_allocate_run(uint64_t count, uint64_t goal)
+{
+	fsGroup *goalGroup = fs_group_of(goal);
+
+	for (int attempt = 0; attempt <= fsGroupCount; attempt++) {
+		fsGroup *grp = fs_group_attempt(goalGroup, attempt);
+		if (grp == NULL) {
+			continue;
+		}
+		uint64_t start = 0;
+		if (grp->free >= count) {
+			start = fs_group_find_run(grp, (grp == goalGroup) ? goal : 0, count);
+		}
+		if (start != 0) {
+			setFATRun(start, count);
+			if (start == grp->next) {
+				grp->next = start + count;
+			}
+		}
+		pthread_mutex_unlock(&grp->lock);
+		if (start != 0) {
+			return start;
+		}
+	}
+	return 0;
+}
+
+// allocate numberOfBlocks consecutive blocks, chained in order. With a
+// goal a run within one allocation group is looked for first. Otherwise
+// the first free run long enough is taken, looking from goal
+// (nextFreeBlock if 0) to the end of the volume and then from its start,
+// with the whole FAT locked. Returns 0 if there is no such run.
+uint64_t allocateContiguousBlocks(uint64_t numberOfBlocks, uint64_t goal)
+{
+	uint64_t startBlock = 0;
+
+	if (goal != 0) {
+		startBlock = fs_groups_allocate_run(numberOfBlocks, goal);
+		if (startBlock != 0) {
+			return startBlock;
+		}
+	}
+
+	pthread_mutex_lock(&fsFATLock);
+	fs_groups_lock_all();
+	if (goal == 0) {
+		goal = fsVCB.nextFreeBlock;
+	}
+	for (int pass = 0; pass < 3 && startBlock == 0; pass++) {
+		uint64_t block = (pass == 0) ? goal : fsDataFirst;
+		uint64_t end = (pass == 1) ? goal + numberOfBlocks : fsVCB.numBlocks;
+		if (end > fsVCB.numBlocks) {
+			end = fsVCB.numBlocks;
+		}
+		if (pass == 2) {
+			// last try, with the chains of deleted files freed
+			if (fsVCB.orphanCount == 0) {
+				break;
+			}
+			reclaimOrphans();
+		}
+		uint64_t run = 0;
+		for (; block < end; block++) {
+			run = (getFATEntry(block) == 0) ? run + 1 : 0;
+			if (run == numberOfBlocks) {
+				startBlock = block + 1 - run;
+				break;
+			}
+		}
+	}
+	if (startBlock != 0) {
+		setFATRun(startBlock, numberOfBlocks);
+		if (fsVCB.nextFreeBlock >= startBlock
+			&& fsVCB.nextFreeBlock < startBlock + numberOfBlocks) {
+			fsVCB.nextFreeBlock = findFreeBlock(startBlock + numberOfBlocks);
+			writeVCB();
+		}
+	}
+	fs_groups_unlock_all();
+	pthread_mutex_unlock(&fsFATLock);
+	return startBlock;
+}
+
+void fs_set_alloc_mode(int mode)
+{
+	fsAllocMode = mode;
+}
+
+int fs_get_alloc_mode(void)
+{
+	return fsAllocMode;
+}
+
+// where to look for blocks of a file in the directory starting at
+// dirBlock, 0 for nextFreeBlock
+uint64_t fs_alloc_goal(uint64_t dirBlock)
+{
+	if (fsAllocMode != FS_ALLOC_GROUPS || dirBlock == 0) {
+		return 0;
+	}
+	fsGroup *grp = fs_group_of(dirBlock);
+	pthread_mutex_lock(&grp->lock);
+	uint64_t goal = (grp->next > dirBlock) ? grp->next : dirBlock;
+	pthread_mutex_unlock(&grp->lock);
+	return goal;
+}
+
+// where to put a new directory: in the group with the most free blocks,
+// so that directories spread over the volume and each has room nearby
+// for its files
+uint64_t fs_dir_goal(void)
+{
+	if (fsAllocMode != FS_ALLOC_GROUPS) {
+		return 0;
+	}
+	int64_t most = -1;
+	uint64_t goal = 0;
+	for (int g = 0; g < fsGroupCount; g++) {
+		pthread_mutex_lock(&fsGroups[g].lock);
+		if (fsGroups[g].free > most) {
+			most = fsGroups[g].free;
+			goal = fsGroups[g].next;
+		}
+		pthread_mutex_unlock(&fsGroups[g].lock);
+	}
+	return goal;
+}
+
+// where to look for new blocks of a file: right after its last block, or
+// in the group of its directory
+uint64_t fat_alloc_goal(fat_file_blockinfo *bi)
+{
+	if (fsAllocMode != FS_ALLOC_GROUPS) {
+		return 0;
+	}
+	if (bi->tail_block != 0) {
+		return bi->tail_block + 1;
+	}
+	return fs_alloc_goal(bi->dir_lba / fsVCB.numLBAPerBlock);
+}
+
+// count a run of run free blocks
+void fs_space_add_run(struct fs_space_stats *st, uint64_t run)
+{
+	int bucket = 0;
+	while (bucket + 1 < FS_SPACE_BUCKETS && (run >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	st->freeRuns[bucket]++;
+	st->freeExtents++;
+	if (run > st->largestFree) {
+		st->largestFree = run;
+	}
+}
+
+// FAT blocks read with each call by fs_space_stats
+#define FS_SPACE_SCAN_BLOCKS	64
+
+int fs_space_stats(struct fs_space_stats *st)
+{
+	memset(st, 0, sizeof(struct fs_space_stats));
+	st->blocks = fsVCB.numBlocks;
+	st->blockSize = fsVCB.blockSize;
+	st->metaBlocks = fsDataFirst;
+	st->freeCounted = fs_free_blocks();
+
+	// the FAT read whole blocks at a time, as it is on disk: every change
+	// is written through
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	uint64_t numBlocksFAT = fsDataFirst - 1;
+	uint32_t *buffer = malloc(FS_SPACE_SCAN_BLOCKS * fsVCB.blockSize);
+	uint64_t run = 0;
+	pthread_mutex_lock(&fsFATLock);
+	fs_groups_lock_all();
+	for (uint64_t b = 0; b < numBlocksFAT; b += FS_SPACE_SCAN_BLOCKS) {
+		uint64_t n = numBlocksFAT - b;
+		if (n > FS_SPACE_SCAN_BLOCKS) {
+			n = FS_SPACE_SCAN_BLOCKS;
+		}
+		fs_lba_read(buffer, n * fsVCB.numLBAPerBlock, (b + 1) * fsVCB.numLBAPerBlock);
+		for (uint64_t j = 0; j < n * perBlock; j++) {
+			uint64_t block = b * perBlock + j;
+			if (block < fsVCB.numBlocks && buffer[j] == 0) {
+				st->freeBlocks++;
+				run++;
+				continue;
+			}
+			if (run > 0) {
+				fs_space_add_run(st, run);
+				run = 0;
+			}
+			if (block >= fsVCB.numBlocks) {
+				break;
+			}
+		}
+	}
+	if (run > 0) {
+		fs_space_add_run(st, run);
+	}
+	fs_groups_unlock_all();
+	pthread_mutex_unlock(&fsFATLock);
+	free(buffer);
+	return 0;
+}
+
+//
+// Discard
+//
+// Blocks freed are punched out of the host volume file, so that it only
+// takes disk space for the blocks in use. fsLow does not share its file
+// descriptor: the volume file is opened once more for this.
+//
+
+int fsDiscardMode = FS_DISCARD_ON;
+
+int fs_volume_open(const char *volumeFile)
+{
+	fsVolumeFd = open(volumeFile, O_RDWR);
+	return (fsVolumeFd < 0) ? -1 : 0;
+}
+
+void fs_set_discard(int mode)
+{
+	fsDiscardMode = mode;
+}
+
+int fs_get_discard(void)
+{
+	return (fsVolumeFd < 0) ? FS_DISCARD_OFF : fsDiscardMode;
+}
+
+int64_t fs_volume_disk_usage(void)
+{
+	struct stat st;
+	if (fsVolumeFd < 0 || fstat(fsVolumeFd, &st) != 0) {
+		return -1;
+	}
+	return (int64_t) st.st_blocks * 512;
+}
+
+// punch count blocks from block on out of the volume file
+void fs_discard_extent(uint64_t block, uint64_t count)
+{
+	if (fs_get_discard() == FS_DISCARD_OFF || count == 0) {
+		return;
+	}
+
+	// the partition header of fsLow comes before LBA 0
+	off_t offset = (block * fsVCB.numLBAPerBlock + 1) * MINBLOCKSIZE;
+	if (fallocate(fsVolumeFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  offset, count * fsVCB.blockSize) != 0) {
+		// host file system cannot punch holes, do not try again
+		fprintf(stderr, "ERROR(%s): discard turned off\n", __func__);
+		fsDiscardMode = FS_DISCARD_OFF;
+		return;
+	}
+	pthread_mutex_lock(&fsStatsLock);
+	fsStats.discardCalls++;
+	fsStats.blocksDiscarded += count;
+	pthread_mutex_unlock(&fsStatsLock);
+}
+
+int fs_block_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+// free blocks[0..numBlocks-1], sorting them first so that every FAT block
+// is written once however many of them have entries in it
+void freeBlockList(uint32_t *blocks, uint64_t numBlocks)
+{
+	pthread_mutex_lock(&fsFATLock);
+	qsort(blocks, numBlocks, sizeof(uint32_t), fs_block_compare);
+
+	// discard runs of consecutive blocks with one call each, while they
+	// are still allocated: once free, another thread may write them
+	for (uint64_t j = 0; j < numBlocks; ) {
+		uint64_t k = j + 1;
+		while (k < numBlocks && blocks[k] == blocks[k - 1] + 1) {
+			k++;
+		}
+		fs_discard_extent(blocks[j], k - j);
+		j = k;
+	}
+
+	uint32_t perBlock = fsVCB.blockSize / 4;
+	uint64_t i = 0;
+	while (i < numBlocks) {
+		fsGroup *grp = fs_group_of(blocks[i]);
+		fs_group_lock(grp);
+		uint32_t *entries = fs_group_entry(grp, blocks[i]) - blocks[i] % perBlock;
+		uint64_t fatEnd = (blocks[i] / perBlock + 1) * perBlock;
+		if (blocks[i] < grp->next) {
+			grp->next = blocks[i];
+		}
+		for (; i < numBlocks && blocks[i] < fatEnd; i++) {
+			entries[blocks[i] % perBlock] = 0;
+			grp->free++;
+		}
+		fs_group_entry_write(grp);
+		pthread_mutex_unlock(&grp->lock);
+	}
+
+	// update nextFreeBlock in VCB
+	if (numBlocks > 0 && blocks[0] < fsVCB.nextFreeBlock) {
+		fsVCB.nextFreeBlock = blocks[0];
+		writeVCB();
+	}
+	pthread_mutex_unlock(&fsFATLock);
+}
+
+// free the chains starting at each of heads[0..count-1] at once: the
+// blocks of all chains are gathered and freed together.
+// returns the number of blocks freed
+uint64_t freeAllocatedChains(const uint64_t *heads, int count)
+{
+	uint64_t numBlocks = 0;
+	uint64_t maxBlocks = 64;
+	uint32_t *blocks = malloc(maxBlocks * sizeof(uint32_t));
+
+	pthread_mutex_lock(&fsFATLock);
+	for (int i = 0; i < count; i++) {
+		uint32_t block = heads[i];
+		while (block != 0 && block != 0xFFFFFFFF) {
+			if (numBlocks == maxBlocks) {
+				maxBlocks *= 2;
+				blocks = realloc(blocks, maxBlocks * sizeof(uint32_t));
+			}
+			blocks[numBlocks++] = block;
+			block = getFATEntry(block);
+		}
+	}
+	if (numBlocks > 0) {
+		freeBlockList(blocks, numBlocks);
+	}
+	pthread_mutex_unlock(&fsFATLock);
+	free(blocks);
+	return numBlocks;
+}
+
+void freeAllocatedBlocks(uint64_t startBlock)
+{
+	if (startBlock == 0) {
+		fprintf(stderr, "ERROR(%s): startBlock shall not be 0\n", __func__);
+		return;
+	}
+	freeAllocatedChains(&startBlock, 1);
+}
+
+//
+// Deferred reclamation
+//
+// A delete only detaches the chain of the file: its start block is added
+// to the orphans kept in the VCB, which costs one write however long the
+// chain is. The reclaimer thread frees the orphans in bulk a moment later,
+// and whatever it did not get to before unmount is freed after the next
+// mount. The orphans are guarded by fsFATLock, which is recursive and so
+// cannot be waited on: the reclaimer waits on fsReclaimLock, a leaf lock
+// of its own, for fsReclaimPending.
+//
+
+pthread_t fsReclaimer;
+pthread_mutex_t fsReclaimLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fsReclaimCond = PTHREAD_COND_INITIALIZER;
+int fsReclaimPending = 0;			// orphans queued since the last pass
+int fsReclaimStop = 0;
+int fsReclaimRunning = 0;
+
+// free every orphaned chain now
+void reclaimOrphans(void)
+{
+	pthread_mutex_lock(&fsFATLock);
+	if (fsVCB.orphanCount > 0) {
+		uint64_t heads[FS_ORPHAN_MAX];
+		for (int i = 0; i < fsVCB.orphanCount; i++) {
+			heads[i] = fsVCB.orphans[i];
+		}
+		fsStats.blocksReclaimed += freeAllocatedChains(heads, fsVCB.orphanCount);
+		fsVCB.orphanCount = 0;
+		writeVCB();
+	}
+	pthread_mutex_unlock(&fsFATLock);
+}
+
+void fs_reclaim(void)
+{
+	reclaimOrphans();
+}
+
+// detach the chain starting at startBlock, to be freed by the reclaimer
+void deferFreeBlocks(uint64_t startBlock)
+{
+	pthread_mutex_lock(&fsFATLock);
+	if (fsVCB.orphanCount == FS_ORPHAN_MAX) {
+		reclaimOrphans();
+	}
+	fsVCB.orphans[fsVCB.orphanCount++] = startBlock;
+	writeVCB();
+	fsStats.chainsDeferred++;
+	pthread_mutex_lock(&fsReclaimLock);
+	if (!fsReclaimPending) {
+		fsReclaimPending = 1;
+		pthread_cond_signal(&fsReclaimCond);
+	}
+	pthread_mutex_unlock(&fsReclaimLock);
+	pthread_mutex_unlock(&fsFATLock);
+}
+
+void *fs_reclaimer(void *arg)
+{
+	pthread_mutex_lock(&fsReclaimLock);
+	while (!fsReclaimStop) {
+		if (!fsReclaimPending) {
+			pthread_cond_wait(&fsReclaimCond, &fsReclaimLock);
+			continue;
+		}
+
+		// let more deletes gather before freeing them together
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += FS_RECLAIM_DELAY_MS * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		while (!fsReclaimStop
+			   && pthread_cond_timedwait(&fsReclaimCond, &fsReclaimLock, &until) == 0) {
+		}
+		if (!fsReclaimStop) {
+			// fsFATLock comes first
+			fsReclaimPending = 0;
+			pthread_mutex_unlock(&fsReclaimLock);
+			reclaimOrphans();
+			pthread_mutex_lock(&fsReclaimLock);
+		}
+	}
+	pthread_mutex_unlock(&fsReclaimLock);
+	return NULL;
+}
+
+void fs_reclaimer_start(void)
+{
+	fsReclaimStop = 0;
+	// chains left over from before the last unmount
+	fsReclaimPending = (fsVCB.orphanCount > 0);
+	if (pthread_create(&fsReclaimer, NULL, fs_reclaimer, NULL) != 0) {
+		// deletes still work, the orphans are then freed under pressure
+		fprintf(stderr, "ERROR(%s): cannot start reclaimer\n", __func__);
+		return;
+	}
+	fsReclaimRunning = 1;
+}
+
+void fs_reclaimer_stop(void)
+{
+	if (!fsReclaimRunning) {
+		return;
+	}
+	pthread_mutex_lock(&fsReclaimLock);
+	fsReclaimStop = 1;
+	pthread_cond_signal(&fsReclaimCond);
+	pthread_mutex_unlock(&fsReclaimLock);
+	pthread_join(fsReclaimer, NULL);
+	fsReclaimRunning = 0;
+}
+
+fat_file_blockinfo * fat_get_file_blockinfo(int startBlockNumber)
+{
+	uint32_t nextBlock = getFATEntry(startBlockNumber);
+	if (nextBlock == 0) {
+		fprintf(stderr, "ERROR(%s): not an allocated FAT entry\n", __func__);
+		return NULL;
+	}
+
+	fat_file_blockinfo * bi = calloc(1, sizeof(fat_file_blockinfo));
+	bi->block_size = fsVCB.blockSize;
+	bi->table_blocknumbers = calloc(1, sizeof(int));
+	bi->table_blocknumbers[0] = startBlockNumber;
+	bi->total_blocks = 1;
+
+	while (nextBlock != 0xFFFFFFFF) {
+		bi->table_blocknumbers = reallocarray(bi->table_blocknumbers, 
+											  bi->total_blocks + 1,
+											  sizeof(int));
+		bi->table_blocknumbers[bi->total_blocks] = nextBlock;
+        bi->total_blocks++;
+
+		nextBlock = getFATEntry(nextBlock);
+	}
+
+	bi->alloc_blocks = bi->total_blocks;
+	bi->head_block = startBlockNumber;
+	bi->tail_block = bi->table_blocknumbers[bi->total_blocks - 1];
+	return bi;
+}
+
+// entry of the block map for a block reserved and not written yet
+#define FAT_MAP_UNWRITTEN	0x80000000
+
+// block info of a sparse file of fileSize bytes, whose chain starts with
+// mapBlocks blocks of map
+fat_file_blockinfo * fat_get_file_map(int startBlockNumber, int mapBlocks, uint64_t fileSize)
+{
+	fat_file_blockinfo * bi = fat_get_file_blockinfo(startBlockNumber);
+	if (bi == NULL || bi->total_blocks < mapBlocks) {
+		fprintf(stderr, "ERROR(%s): chain shorter than the map\n", __func__);
+		return bi;
+	}
+
+	bi->map_blocks = mapBlocks;
+	bi->map_blocknumbers = calloc(mapBlocks, sizeof(int));
+	memcpy(bi->map_blocknumbers, bi->table_blocknumbers, mapBlocks * sizeof(int));
+
+	// the map gives the block of every block of the file, and of the
+	// blocks reserved past its end
+	int perBlock = fsVCB.blockSize / 4;
+	int totalBlocks = (fileSize + fsVCB.blockSize - 1) / fsVCB.blockSize;
+	int *table = calloc(mapBlocks * perBlock + 1, sizeof(int));
+	uint32_t *buffer = malloc(fsVCB.blockSize);
+	for (int m = 0; m < mapBlocks; m++) {
+		readBlock(buffer, bi->map_blocknumbers[m]);
+		for (int j = 0; j < perBlock; j++) {
+			table[m * perBlock + j] = buffer[j] & ~FAT_MAP_UNWRITTEN;
+			if (buffer[j] & FAT_MAP_UNWRITTEN) {
+				fat_set_unwritten(bi, m * perBlock + j, 1);
+			}
+			if (buffer[j] != 0 && m * perBlock + j >= totalBlocks) {
+				totalBlocks = m * perBlock + j + 1;
+			}
+		}
+	}
+	free(buffer);
+	if (totalBlocks > mapBlocks * perBlock) {
+		totalBlocks = mapBlocks * perBlock;
+	}
+	free(bi->table_blocknumbers);
+	bi->table_blocknumbers = table;
+	bi->total_blocks = totalBlocks;
+	return bi;
+}
+
+// block info of a file without blocks
+fat_file_blockinfo * fat_new_file_blockinfo(void)
+{
+	fat_file_blockinfo * bi = calloc(1, sizeof(fat_file_blockinfo));
+	bi->block_size = fsVCB.blockSize;
+	bi->total_blocks = 0;
+	bi->table_blocknumbers = NULL;
+	return bi;
+}
+
+void fat_free_file_blockinfo(fat_file_blockinfo *bi)
+{
+	if (bi != NULL) {
+		free(bi->table_blocknumbers);
+		free(bi->map_blocknumbers);
+		free(bi->unwritten);
+		free(bi);
+	}
+}
+
+// whether block index of the file has no block yet
+int fat_is_hole(fat_file_blockinfo *bi, int index)
+{
+	return index >= bi->total_blocks || bi->table_blocknumbers[index] == 0;
+}
+
+// whether block index of the file is reserved and not written yet: it
+// reads as zeros without being read
+int fat_is_unwritten(fat_file_blockinfo *bi, int index)
+{
+	return index < bi->unwritten_size && bi->unwritten[index];
+}
+
+void fat_set_unwritten(fat_file_blockinfo *bi, int index, int unwritten)
+{
+	if (index >= bi->unwritten_size) {
+		if (!unwritten) {
+			return;
+		}
+		int size = (bi->unwritten_size * 2 > bi->total_blocks)
+				   ? bi->unwritten_size * 2 : bi->total_blocks;
+		if (size <= index) {
+			size = index + 1;
+		}
+		bi->unwritten = realloc(bi->unwritten, size);
+		memset(bi->unwritten + bi->unwritten_size, 0, size - bi->unwritten_size);
+		bi->unwritten_size = size;
+	}
+	bi->unwritten[index] = unwritten;
+}
+
+// block holding block index of the file. A hole gets a new block at the
+// end of the chain; blocks in between are left as holes. Returns 0 if
+// the volume is full.
+int fat_map_block(fat_file_blockinfo *bi, int index)
+{
+	if (!fat_is_hole(bi, index)) {
+		return bi->table_blocknumbers[index];
+	}
+	uint32_t newBlock = allocateFreeBlocksNear(1, fat_alloc_goal(bi));
+	if (newBlock == 0) {
+		return 0;
+	}
+	if (index >= bi->total_blocks) {
+		bi->table_blocknumbers = reallocarray(bi->table_blocknumbers,
+											  index + 1, sizeof(int));
+		memset(bi->table_blocknumbers + bi->total_blocks, 0,
+			   (index + 1 - bi->total_blocks) * sizeof(int));
+		bi->total_blocks = index + 1;
+	}
+
+	if (index + 1 < bi->total_blocks) {
+		// a block ahead of others: the chain leaves file order
+		bi->unordered = 1;
+	}
+
+	if (bi->tail_block != 0) {
+		setFATEntry(bi->tail_block, newBlock);
+	}
+	else {
+		bi->head_block = newBlock;
+	}
+	bi->tail_block = newBlock;
+	bi->alloc_blocks++;
+
+	bi->table_blocknumbers[index] = newBlock;
+	return newBlock;
+}
+
+int fat_add_block(fat_file_blockinfo *bi)
+{
+	return (fat_map_block(bi, bi->total_blocks) != 0) ? 0 : -1;
+}
+
+// give blocks to the holes of block indexes first .. last, from one free
+// run if there is one, and return how many were allocated. Returns -1,
+// with nothing allocated, if there are not enough free blocks.
+int fat_reserve_blocks(fat_file_blockinfo *bi, int first, int last)
+{
+	int holes = 0;
+	for (int i = first; i <= last; i++) {
+		holes += fat_is_hole(bi, i);
+	}
+	if (holes == 0) {
+		return 0;
+	}
+	if (!fs_have_free_blocks(holes)) {
+		return -1;
+	}
+
+	uint64_t goal = fat_alloc_goal(bi);
+	uint32_t block = allocateContiguousBlocks(holes, goal);
+	if (block == 0) {
+		block = allocateFreeBlocksNear(holes, goal);
+	}
+	if (block == 0) {
+		return -1;
+	}
+
+	if (first + 1 < bi->total_blocks) {
+		bi->unordered = 1;
+	}
+	if (last >= bi->total_blocks) {
+		bi->table_blocknumbers = reallocarray(bi->table_blocknumbers,
+											  last + 1, sizeof(int));
+		memset(bi->table_blocknumbers + bi->total_blocks, 0,
+			   (last + 1 - bi->total_blocks) * sizeof(int));
+		bi->total_blocks = last + 1;
+	}
+	if (bi->tail_block != 0) {
+		setFATEntry(bi->tail_block, block);
+	}
+	else {
+		bi->head_block = block;
+	}
+	for (int i = first; i <= last; i++) {
+		if (bi->table_blocknumbers[i] == 0) {
+			bi->table_blocknumbers[i] = block;
+			fat_set_unwritten(bi, i, 1);
+			bi->tail_block = block;
+			block = getFATEntry(block);
+		}
+	}
+	bi->alloc_blocks += holes;
+	return holes;
+}
+
+// free the blocks of the file from block index from on, and return how
+// many there were. The rest of the chain keeps its order.
+int fat_trim_blocks(fat_file_blockinfo *bi, int from)
+{
+	if (from < bi->unwritten_size) {
+		memset(bi->unwritten + from, 0, bi->unwritten_size - from);
+	}
+	if (from >= bi->total_blocks) {
+		return 0;
+	}
+	int count = 0;
+	uint32_t *blocks = malloc((bi->total_blocks - from) * sizeof(uint32_t));
+	for (int i = from; i < bi->total_blocks; i++) {
+		if (bi->table_blocknumbers[i] != 0) {
+			blocks[count++] = bi->table_blocknumbers[i];
+		}
+	}
+	bi->total_blocks = from;
+	if (count == 0) {
+		free(blocks);
+		return 0;
+	}
+	qsort(blocks, count, sizeof(uint32_t), fs_block_compare);
+
+	// link each block kept to the next one kept
+	uint32_t prev = 0;
+	uint32_t block = bi->head_block;
+	bi->head_block = 0;
+	while (block != 0 && block != 0xFFFFFFFF) {
+		uint32_t next = getFATEntry(block);
+		if (bsearch(&block, blocks, count, sizeof(uint32_t), fs_block_compare) == NULL) {
+			if (prev == 0) {
+				bi->head_block = block;
+			}
+			else if (getFATEntry(prev) != block) {
+				setFATEntry(prev, block);
+			}
+			prev = block;
+		}
+		block = next;
+	}
+	if (prev != 0 && getFATEntry(prev) != 0xFFFFFFFF) {
+		setFATEntry(prev, 0xFFFFFFFF);
+	}
+	bi->tail_block = prev;
+	bi->alloc_blocks -= count;
+	freeBlockList(blocks, count);
+
+	free(blocks);
+	return count;
+}
+
+// write the map of a file with holes, growing it to cover every block of
+// the file. New map blocks are linked after the old ones, ahead of the data.
+int fat_put_file_map(fat_file_blockinfo *bi)
+{
+	// blocks not written yet need the map to be recorded as such
+	int holes = 0;
+	for (int i = 0; i < bi->total_blocks && !holes; i++) {
+		holes = (bi->table_blocknumbers[i] == 0) || fat_is_unwritten(bi, i);
+	}
+	if (!holes && bi->map_blocks == 0) {
+		if (bi->unordered) {
+			// holes filled since open, put the chain back in file order
+			fat_make_plain(bi);
+		}
+		return -1;
+	}
+
+	int perBlock = fsVCB.blockSize / 4;
+	int needed = (bi->total_blocks + perBlock - 1) / perBlock;
+	uint32_t block = 0;
+	if (needed > bi->map_blocks) {
+		block = allocateFreeBlocksNear(needed - bi->map_blocks, fat_alloc_goal(bi));
+		if (block == 0) {
+			// no room for a larger map: the blocks it cannot cover are
+			// given up
+			fprintf(stderr, "ERROR(%s): no room for the map, file cut to %d blocks\n",
+					__func__, bi->map_blocks * perBlock);
+			fat_trim_blocks(bi, bi->map_blocks * perBlock);
+			if (bi->map_blocks == 0) {
+				return -1;
+			}
+		}
+	}
+	if (block != 0) {
+		int extra = needed - bi->map_blocks;
+		bi->map_blocknumbers = reallocarray(bi->map_blocknumbers, needed, sizeof(int));
+
+		for (int m = bi->map_blocks; m < needed; m++) {
+			bi->map_blocknumbers[m] = block;
+			block = getFATEntry(block);
+		}
+		uint32_t last = bi->map_blocknumbers[needed - 1];
+		uint32_t data = bi->head_block;
+		if (bi->map_blocks > 0) {
+			data = getFATEntry(bi->map_blocknumbers[bi->map_blocks - 1]);
+			setFATEntry(bi->map_blocknumbers[bi->map_blocks - 1],
+						bi->map_blocknumbers[bi->map_blocks]);
+		}
+		else {
+			bi->head_block = bi->map_blocknumbers[0];
+		}
+		if (data != 0 && data != 0xFFFFFFFF) {
+			setFATEntry(last, data);
+		}
+		else {
+			bi->tail_block = last;
+		}
+		bi->alloc_blocks += extra;
+		bi->map_blocks = needed;
+	}
+
+	uint32_t *buffer = malloc(fsVCB.blockSize);
+	for (int m = 0; m < bi->map_blocks; m++) {
+		memset(buffer, 0, fsVCB.blockSize);
+		for (int j = 0; j < perBlock && m * perBlock + j < bi->total_blocks; j++) {
+			buffer[j] = bi->table_blocknumbers[m * perBlock + j];
+			if (fat_is_unwritten(bi, m * perBlock + j)) {
+				buffer[j] |= FAT_MAP_UNWRITTEN;
+			}
+		}
+		writeBlock(buffer, bi->map_blocknumbers[m]);
+	}
+	free(buffer);
+	return 0;
+}
+
+// turn a sparse file into a plain chain: holes get blocks of zeros, as
+// do blocks not written yet, the chain is linked again in file order and
+// the map is freed
+void fat_make_plain(fat_file_blockinfo *bi)
+{
+	char *zeros = calloc(1, fsVCB.blockSize);
+	for (int i = 0; i < bi->total_blocks; i++) {
+		if (fat_is_unwritten(bi, i)) {
+			writeBlock(zeros, bi->table_blocknumbers[i]);
+			fat_set_unwritten(bi, i, 0);
+		}
+		else if (bi->table_blocknumbers[i] == 0) {
+			int block = fat_map_block(bi, i);
+			if (block == 0) {
+				// volume full: the file ends at its first hole
+				fprintf(stderr, "ERROR(%s): no room for holes, file cut to %d blocks\n",
+						__func__, i);
+				fat_trim_blocks(bi, i);
+				break;
+			}
+			writeBlock(zeros, block);
+		}
+	}
+	free(zeros);
+
+	for (int i = 0; i + 1 < bi->total_blocks; i++) {
+		if (getFATEntry(bi->table_blocknumbers[i]) != bi->table_blocknumbers[i + 1]) {
+			setFATEntry(bi->table_blocknumbers[i], bi->table_blocknumbers[i + 1]);
+		}
+	}
+	if (bi->total_blocks > 0) {
+		setFATEntry(bi->table_blocknumbers[bi->total_blocks - 1], 0xFFFFFFFF);
+	}
+	if (bi->map_blocks > 0) {
+		for (int m = 0; m + 1 < bi->map_blocks; m++) {
+			setFATEntry(bi->map_blocknumbers[m], bi->map_blocknumbers[m + 1]);
+		}
+		setFATEntry(bi->map_blocknumbers[bi->map_blocks - 1], 0xFFFFFFFF);
+		uint64_t head = bi->map_blocknumbers[0];
+		freeAllocatedChains(&head, 1);
+	}
+
+	free(bi->map_blocknumbers);
+	bi->map_blocknumbers = NULL;
+	bi->map_blocks = 0;
+	bi->alloc_blocks = bi->total_blocks;
+	bi->unordered = 0;
+	bi->head_block = (bi->total_blocks > 0) ? bi->table_blocknumbers[0] : 0;
+	bi->tail_block = (bi->total_blocks > 0) ? bi->table_blocknumbers[bi->total_blocks - 1] : 0;
+}
+
+// first of count consecutive free blocks taken for the file of bi, near
+// its directory, 0 if there is no such run
+int fat_alloc_run(fat_file_blockinfo *bi, int count)
+{
+	return allocateContiguousBlocks(count, fs_alloc_goal(bi->dir_lba / fsVCB.numLBAPerBlock));
+}
+
+// first of count consecutive free blocks taken from the lowest run long
+// enough, if it starts before block below; 0 if there is none
+int fat_alloc_low_run(int count, int below)
+{
+	uint64_t startBlock = 0;
+	uint64_t run = 0;
+
+	pthread_mutex_lock(&fsFATLock);
+	fs_groups_lock_all();
+	for (uint64_t block = fsVCB.nextFreeBlock; block < below && block < fsVCB.numBlocks; block++) {
+		run = (getFATEntry(block) == 0) ? run + 1 : 0;
+		if (run == count) {
+			startBlock = block + 1 - run;
+			break;
+		}
+	}
+	if (startBlock != 0) {
+		setFATRun(startBlock, count);
+		if (fsVCB.nextFreeBlock >= startBlock
+			&& fsVCB.nextFreeBlock < startBlock + count) {
+			fsVCB.nextFreeBlock = findFreeBlock(startBlock + count);
+			writeVCB();
+		}
+	}
+	fs_groups_unlock_all();
+	pthread_mutex_unlock(&fsFATLock);
+	return startBlock;
+}
+
+// chain starting at head no longer used, freed by the reclaimer
+void fat_free_chain(int head)
+{
+	deferFreeBlocks(head);
+}
+
+// int returned is block number where dir starts
+int initDirectory(directoryEntry *parent)
+{
+	// if NULL is passed in then its init the root dir
+	// malloc mem to hold DE arr
+	// allocate blocks to hold DE arr
+	// init each DE to a known state (avail)
+	// init . dir
+	// init .. dir
+	// LBAwrite all blocks of root dir
+	// free alloc'd mem
+	// return block num for start of dir
+	return 1;
+}
+
+// bytes of a cluster, the block of the file system that each FAT entry
+// maps, for the next format; 0 for one LBA
+uint64_t fsClusterSize = 0;
+
+void fs_set_cluster_size(uint64_t bytes)
+{
+	fsClusterSize = bytes;
+}
+
+// format the volume even if it holds a file system
+int fsFormatRequested = 0;
+
+void fs_set_format(int format)
+{
+	fsFormatRequested = format;
+}
+
+int initFileSystem(uint64_t numberOfBlocks, uint64_t blockSize)
+{
+	printf("Initializing File System with %ld blocks with a block size of %ld\n", numberOfBlocks, blockSize);
+	/* TODO: Add any code you need to initialize your file system. */
+
+	struct vcb *buffer = malloc(MINBLOCKSIZE);
+
+	// read the first block to check the signature.
+	fs_lba_read(buffer, 1, 0);
+
+	// a file system of another version is only erased when asked to
+	int valid = (buffer->sig == 0x4E415445 && buffer->formatVersion == FS_FORMAT_VERSION);
+	if (buffer->sig == 0x4E415445 && !valid && !fsFormatRequested) {
+		fprintf(stderr, "ERROR(%s): volume has format version %d, need %d; "
+				"not mounted, format it to use it\n", __func__,
+				buffer->formatVersion, FS_FORMAT_VERSION);
+		free(buffer);
+		return -1;
+	}
+
+	// if it does not match, vcb needs to be formatted
+	if (!valid || fsFormatRequested)
+	{
+		if (valid) {
+			printf("Formatting filesystem as asked\n");
+		}
+		else {
+			printf("No valid VCB, need to format filesystem\n");
+		}
+
+		// from here on a block is a cluster of LBAs
+		if (fsClusterSize > blockSize) {
+			if (fsClusterSize > FS_CLUSTER_MAX || fsClusterSize % blockSize != 0
+				|| (fsClusterSize & (fsClusterSize - 1)) != 0) {
+				fprintf(stderr, "ERROR(%s): bad cluster size %ld, using %ld\n", __func__,
+						fsClusterSize, blockSize);
+			}
+			else {
+				numberOfBlocks = numberOfBlocks / (fsClusterSize / blockSize);
+				blockSize = fsClusterSize;
+				printf("Formatting with %ld clusters of %ld bytes\n", numberOfBlocks, blockSize);
+			}
+		}
+
+		// initialize VCB volume data
+		fsVCB.numBlocks = numberOfBlocks;
+		fsVCB.blockSize = blockSize;
+		fsVCB.numLBAPerBlock = blockSize / MINBLOCKSIZE;
+		fsVCB.sig = 0x4E415445;
+		fsVCB.formatVersion = FS_FORMAT_VERSION;
+		fsVCB.cleanUnmount = 0;
+		fs_groups_layout();
+
+		// initialize the FAT
+		// number of blocks required for size of table
+		uint64_t numBlocksFAT = ((numberOfBlocks * 4) + (blockSize - 1)) / blockSize;
+		char * FATBuffer = malloc(blockSize);
+		memset(FATBuffer, 0x00, blockSize);
+
+		for (int i = 1; i <= numBlocksFAT; i++) {
+			// at initialization, FAT is completely free
+			writeBlock(FATBuffer, i);
+		}
+		free(FATBuffer);
+		FATBuffer = NULL;
+		fs_groups_count();
+
+		// Mark the already  used blocks
+		// 		block 0: VCB
+		// 		block 1 ~ numBlocksFAT: FAT
+		for (int i = 0; i <= numBlocksFAT; i++) {
+			setFATEntry(i, 0xFFFFFFFF);
+		}
+
+		fsVCB.nextFreeBlock = numBlocksFAT + 1;
+
+		// initialize the root directory
+		fsVCB.rootDirStart = initRootDirectory(blockSize);
+
+		// drop whatever an earlier format left in the free blocks
+		fs_discard_extent(fsVCB.nextFreeBlock, fsVCB.numBlocks - fsVCB.nextFreeBlock);
+		
+		// finish formatting by writing VCB to block 0
+		fsVCB.freeBlockCount = fs_free_blocks();
+		memset(buffer, 0, MINBLOCKSIZE);
+		memcpy(buffer, &fsVCB, sizeof(struct vcb));
+		fs_lba_write(buffer, 1, 0);
+	}
+	else 
+	{
+		memcpy(&fsVCB, buffer, sizeof(struct vcb));
+		fs_groups_layout();
+
+		// after a clean unmount the VCB has the free blocks of every group,
+		// otherwise they are counted from the FAT
+		if (!fs_groups_load_summary()) {
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			fs_groups_count();
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			printf("Scanned FAT of %d groups with %d threads in %.3f ms\n",
+				   fsGroupCount, fsScanThreads,
+				   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+		}
+
+		// the summary is stale as soon as anything is allocated
+		fsVCB.cleanUnmount = 0;
+		writeVCB();
+	}
+	free(buffer);
+
+	fs_hash_match_init();
+	fs_setcwd("/");
+
+	// also frees chains left over from before the last unmount
+	fs_reclaimer_start();
+	return 0;
+}
+
+void exitFileSystem()
+{
+	printf("System exiting\n");
+
+	// orphans not freed yet stay in the VCB for the next mount
+	fs_reclaimer_stop();
+
+	// release working directory and cached directories
+	fs_dcache_release();
+
+	// nothing allocates now, so the free counts can go in the VCB
+	pthread_mutex_lock(&fsFATLock);
+	fs_groups_save_summary();
+	fsVCB.cleanUnmount = 1;
+	pthread_mutex_unlock(&fsFATLock);
+	writeVCB();
+
+	// free buffers for FAT
+	fs_groups_release();
+
+	if (fsVolumeFd >= 0) {
+		close(fsVolumeFd);
+		fsVolumeFd = -1;
+	}
+}
+
+//
+// Filesystem interfaces
+//
+
+char fsCurrWorkDir[CWDMAX_LEN];
+fdDir *fsFdDirOpened = NULL;
+
+fdDir * _fs_opendir(const char *pathname);
+int _fs_closedir(fdDir *dirp);
+struct dirCacheSlot;
+inlineDataEntry *fs_inline_record(struct dirCacheSlot *dir, directoryEntry *entry);
+
+void fs_get_stats(struct fs_perfstats *stats)
+{
+	FS_DIR_LOCK();
+	pthread_mutex_lock(&fsFATLock);
+	pthread_mutex_lock(&fsStatsLock);
+	memcpy(stats, &fsStats, sizeof(struct fs_perfstats));
+	pthread_mutex_unlock(&fsStatsLock);
+	pthread_mutex_unlock(&fsFATLock);
+}
+
+void fs_reset_stats(void)
+{
+	FS_DIR_LOCK();
+	pthread_mutex_lock(&fsFATLock);
+	pthread_mutex_lock(&fsStatsLock);
+	memset(&fsStats, 0, sizeof(struct fs_perfstats));
+	pthread_mutex_unlock(&fsStatsLock);
+	pthread_mutex_unlock(&fsFATLock);
+}
+
+// FNV-1a hash of the first len characters of a name
+uint32_t fs_name_hashn(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len && i < DE_NAME_MAXLEN && name[i] != 0; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t fs_name_hash(const char *name)
+{
+	return fs_name_hashn(name, DE_NAME_MAXLEN);
+}
+
+// compare name of entry with the first len characters of name
+int fs_name_equal(const char *entryName, const char *name, size_t len)
+{
+	if (len > DE_NAME_MAXLEN) {
+		// no entry has a name that long
+		return 0;
+	}
+	if (memcmp(entryName, name, len) != 0) {
+		return 0;
+	}
+	return entryName[len] == 0;
+}
+
+//
+// Bloom filter of names in a directory
+//
+// FS_BLOOM_WORDS * 64 bits for up to DIRMAX_ENTRIES names, probed at
+// FS_BLOOM_PROBES positions derived from one hash (double hashing).
+//
+
+#define FS_BLOOM_WORDS		16
+#define FS_BLOOM_BITS		(FS_BLOOM_WORDS * 64)
+#define FS_BLOOM_PROBES		3
+
+void fs_bloom_add(uint64_t *filter, uint32_t hash)
+{
+	uint32_t step = (hash >> 17) | 1;
+	for (int i = 0; i < FS_BLOOM_PROBES; i++) {
+		uint32_t bit = (hash + i * step) % FS_BLOOM_BITS;
+		filter[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	}
+}
+
+int fs_bloom_maybe(const uint64_t *filter, uint32_t hash)
+{
+	uint32_t step = (hash >> 17) | 1;
+	for (int i = 0; i < FS_BLOOM_PROBES; i++) {
+		uint32_t bit = (hash + i * step) % FS_BLOOM_BITS;
+		if ((filter[bit / 64] & ((uint64_t) 1 << (bit % 64))) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//
+// Negative lookup cache
+//
+// Remembers (directory, name) pairs known not to exist. Direct-mapped, so
+// a new miss simply replaces whatever was in its slot. Any code adding a
+// name to a directory must call fs_dir_add_name() to invalidate it.
+//
+
+#define NEGCACHE_SLOTS		256
+
+typedef struct {
+	uint64_t dirLocation;
+	uint32_t hash;
+	char name[DE_NAME_MAXLEN + 1];
+} negCacheEntry;
+
+negCacheEntry fsNegCache[NEGCACHE_SLOTS];
+
+negCacheEntry *fs_negcache_slot(uint64_t dirLocation, uint32_t hash)
+{
+	return &fsNegCache[(hash ^ (dirLocation * 2654435761u)) % NEGCACHE_SLOTS];
+}
+
+int fs_negcache_match(negCacheEntry *slot, uint64_t dirLocation,
+					  uint32_t hash, const char *name, size_t len)
+{
+	return slot->dirLocation == dirLocation && slot->hash == hash
+		&& fs_name_equal(slot->name, name, len);
+}
+
+//
+// Vectorized name matching
+//
+// Each cached directory keeps a structure-of-arrays view of its entries:
+// the hash of every name packed in one array and the type of every entry
+// in another, padded to a multiple of 32. A lookup compares the wanted
+// hash against 4 (SSE2) or 8 (AVX2) packed hashes at a time and only compares full names of the
+// entries whose hash matched.
+//
+
+#define DIRMAX_ENTRIES_ALIGNED	((DIRMAX_ENTRIES + 31) & ~31)
+
+int fsScanMode = FS_SCAN_VECTOR;
+
+void fs_set_scan_mode(int mode)
+{
+	fsScanMode = mode;
+}
+
+// bit i of the result is set if hashes[i] == hash, for 32 hashes
+#if defined(__SSE2__)
+__attribute__((target("avx2")))
+uint32_t fs_hash_match32_avx2(const uint32_t *hashes, uint32_t hash)
+{
+	__m256i key = _mm256_set1_epi32(hash);
+	uint32_t mask = 0;
+	for (int i = 0; i < 32; i += 8) {
+		__m256i v = _mm256_load_si256((const __m256i *) (hashes + i));
+		__m256i eq = _mm256_cmpeq_epi32(v, key);
+		mask |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+	}
+	return mask;
+}
+
+uint32_t fs_hash_match32_sse2(const uint32_t *hashes, uint32_t hash)
+{
+	__m128i key = _mm_set1_epi32(hash);
+	uint32_t mask = 0;
+	for (int i = 0; i < 32; i += 4) {
+		__m128i v = _mm_load_si128((const __m128i *) (hashes + i));
+		__m128i eq = _mm_cmpeq_epi32(v, key);
+		mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+	}
+	return mask;
+}
+#endif
+
+uint32_t fs_hash_match32_scalar(const uint32_t *hashes, uint32_t hash)
+{
+	uint32_t mask = 0;
+	for (int i = 0; i < 32; i++) {
+		mask |= (uint32_t) (hashes[i] == hash) << i;
+	}
+	return mask;
+}
+
+uint32_t (*fs_hash_match32)(const uint32_t *, uint32_t) = NULL;
+
+void fs_hash_match_init(void)
+{
+	fs_hash_match32 = fs_hash_match32_scalar;
+#if defined(__SSE2__)
+	fs_hash_match32 = fs_hash_match32_sse2;
+	if (__builtin_cpu_supports("avx2")) {
+		fs_hash_match32 = fs_hash_match32_avx2;
+	}
+#endif
+}
+
+//
+// Directory cache
+//
+// Loaded directories are shared through a small table of reference counted
+// slots, keyed by starting LBA. Every path walk and directory operation
+// borrows a slot, so all of them see the same entries and a directory is
+// only read again once its slot has been recycled. Entry buffers are
+// allocated once per slot and reused.
+//
+// Entries are decoded from the records in the blocks of the directory;
+// each entry remembers the block holding its record and each block how
+// many bytes of records it holds, so an entry that changes is accounted
+// to a block with room (see fs_dcache_place()).
+//
+// Changes to entries are tracked per block: fs_dcache_dirty() marks the
+// block holding an entry and only marked blocks are encoded and written
+// back. Inside
+// fs_batch_begin()/fs_batch_end() write back is deferred to the end of
+// the batch, so several changes to a directory cost one write.
+//
+
+#define DCACHE_SLOTS		16
+#define DIR_MAXBLOCKS		64	// bits of dirtyBlocks
+
+typedef struct dirCacheSlot {
+	uint64_t location;		// starting LBA of directory, 0 if none
+	int refCount;
+	uint64_t lastUsed;
+	int transient;			// allocated because all slots were busy
+	struct dirCacheSlot *nextTransient;
+	directoryEntry *entries;
+	uint64_t dirtyBlocks;		// bit i set if block i was modified
+	uint64_t nameFilter[FS_BLOOM_WORDS];
+
+	// placement of records
+	uint8_t entryBlock[DIRMAX_ENTRIES];	// block holding record of entry
+	uint16_t entryLen[DIRMAX_ENTRIES];		// bytes of record, 0 if none
+	uint16_t blockUsed[DIR_MAXBLOCKS];		// bytes of records in block
+
+	// name hash and type of every entry, for vectorized lookups
+	uint32_t nameHash[DIRMAX_ENTRIES_ALIGNED] __attribute__((aligned(32)));
+	uint8_t entryType[DIRMAX_ENTRIES_ALIGNED];
+} dirCacheSlot;
+
+dirCacheSlot fsDirCache[DCACHE_SLOTS];
+dirCacheSlot *fsDirTransient = NULL;	// transient slots in use
+uint64_t fsDirCacheClock = 0;
+int fsBatchDepth = 0;
+
+// current working directory, pinned in the cache for relative paths
+dirCacheSlot *fsCwdSlot = NULL;
+
+// the blocks of a directory are read and written through one buffer, as
+// a cluster is too large for the stack
+char *fsDirBuffer = NULL;
+
+uint64_t fs_dir_numblocks(void)
+{
+	return (DIR_SIZE + fsVCB.blockSize - 1) / fsVCB.blockSize;
+}
+
+char *fs_dir_buffer(void)
+{
+	if (fsDirBuffer == NULL) {
+		fsDirBuffer = malloc(fs_dir_numblocks() * fsVCB.blockSize);
+	}
+	return fsDirBuffer;
+}
+
+// blocks up to the last one holding records
+int fs_dir_blocks_used(dirCacheSlot *dir)
+{
+	int n = fs_dir_numblocks();
+	while (n > 1 && dir->blockUsed[n - 1] == 0) {
+		n--;
+	}
+	return n;
+}
+
+// bytes of the record of entry i with its inline data, 0 if it has none
+int fs_entry_record_size(dirCacheSlot *dir, int i)
+{
+	directoryEntry *entry = &dir->entries[i];
+	if (!DE_IS_NAMED(entry->type)) {
+		return 0;
+	}
+	int dataLen = 0;
+	if (entry->type == DE_TYPE_FILE && entry->allocBlocks > 0) {
+		dataLen = sizeof(sparseRecord);
+	}
+	else if (entry->type == DE_TYPE_FILE && i + 1 < DIRMAX_ENTRIES
+		&& dir->entries[i + 1].type == DE_TYPE_INLINE) {
+		dataLen = ((inlineDataEntry *) &dir->entries[i + 1])->length;
+	}
+	return DE_RECORD_SIZE(strlen(entry->name), dataLen);
+}
+
+// first block of dir with room for len bytes more, -1 if none
+int fs_dir_block_with_room(dirCacheSlot *dir, int len)
+{
+	int numBlocks = fs_dir_numblocks();
+	for (int b = 0; b < numBlocks; b++) {
+		if (dir->blockUsed[b] + len <= fsVCB.blockSize) {
+			return b;
+		}
+	}
+	return -1;
+}
+
+// whether the record of entry i can grow (or be created) to len bytes
+int fs_dir_room(dirCacheSlot *dir, int i, int len)
+{
+	if (dir->entryLen[i] > 0
+		&& dir->blockUsed[dir->entryBlock[i]] - dir->entryLen[i] + len <= fsVCB.blockSize) {
+		return 1;
+	}
+	return fs_dir_block_with_room(dir, len) >= 0;
+}
+
+// unused entry of dir for a new record with a name of nameLen bytes and
+// dataLen bytes of inline data (which take the next entry too), -1 if
+// the directory is full
+int fs_dir_alloc_entry(dirCacheSlot *dir, size_t nameLen, int dataLen)
+{
+	int count = (dataLen > 0) ? 2 : 1;
+	for (int i = 2; i + count <= DIRMAX_ENTRIES; i++) {
+		if (dir->entries[i].type == DE_TYPE_UNUSED
+			&& (count == 1 || dir->entries[i + 1].type == DE_TYPE_UNUSED)) {
+			return fs_dir_room(dir, i, DE_RECORD_SIZE(nameLen, dataLen)) ? i : -1;
+		}
+	}
+	return -1;
+}
+
+// account the record of entry i to a block after a change, keeping it in
+// its block if it still fits
+void fs_dcache_place(dirCacheSlot *dir, int i)
+{
+	int blocksUsed = fs_dir_blocks_used(dir);
+	int len = fs_entry_record_size(dir, i);
+	int b = dir->entryBlock[i];
+	if (dir->entryLen[i] > 0) {
+		dir->blockUsed[b] -= dir->entryLen[i];
+		dir->dirtyBlocks |= (uint64_t) 1 << b;
+	}
+	if (len > 0) {
+		if (dir->entryLen[i] == 0 || dir->blockUsed[b] + len > fsVCB.blockSize) {
+			b = fs_dir_block_with_room(dir, len);
+		}
+		if (b < 0) {
+			fprintf(stderr, "ERROR(%s): no room for \"%s\"\n", __func__,
+					dir->entries[i].name);
+			len = 0;
+		}
+		else {
+			dir->blockUsed[b] += len;
+			dir->entryBlock[i] = b;
+			dir->dirtyBlocks |= (uint64_t) 1 << b;
+		}
+	}
+	dir->entryLen[i] = len;
+
+	// "." records the blocks in use
+	if (fs_dir_blocks_used(dir) != blocksUsed) {
+		dir->dirtyBlocks |= 1;
+	}
+}
+
+// refresh hash and type of entry i in the arrays of dir
+void fs_dcache_index(dirCacheSlot *dir, int i)
+{
+	directoryEntry *entry = &dir->entries[i];
+	dir->entryType[i] = entry->type;
+	dir->nameHash[i] = DE_IS_NAMED(entry->type) ? fs_name_hash(entry->name) : 0;
+}
+
+// mark the block holding entry of dir as modified
+void fs_dcache_dirty(dirCacheSlot *dir, directoryEntry *entry)
+{
+	int i = entry - dir->entries;
+	fs_dcache_place(dir, i);
+	if (i > 0 && dir->entries[i - 1].type == DE_TYPE_FILE) {
+		// entry may be the inline data of the file before
+		fs_dcache_place(dir, i - 1);
+	}
+	fs_dcache_index(dir, i);
+}
+
+// encode the records of block b of dir
+void fs_dcache_encode(dirCacheSlot *dir, int b, char *block)
+{
+	memset(block, 0, fsVCB.blockSize);
+	int pos = 0;
+	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
+		if (dir->entryLen[i] == 0 || dir->entryBlock[i] != b) {
+			continue;
+		}
+		directoryEntry *entry = &dir->entries[i];
+		if (i == 0) {
+			pos += fs_record_encode(block + pos, entry, NULL, 0, fs_dir_blocks_used(dir));
+		}
+		else if (entry->type == DE_TYPE_FILE && entry->allocBlocks > 0) {
+			sparseRecord sparse = { entry->mapBlocks, entry->allocBlocks };
+			pos += fs_record_encode(block + pos, entry, (char *) &sparse,
+									sizeof(sparseRecord), DE_EXTRA_SPARSE);
+		}
+		else if (entry->type == DE_TYPE_FILE && i + 1 < DIRMAX_ENTRIES
+				 && dir->entries[i + 1].type == DE_TYPE_INLINE) {
+			inlineDataEntry *data = (inlineDataEntry *) &dir->entries[i + 1];
+			pos += fs_record_encode(block + pos, entry, data->data, data->length,
+									data->length);
+		}
+		else {
+			pos += fs_record_encode(block + pos, entry, NULL, 0, 0);
+		}
+	}
+}
+
+// write modified blocks of dir, one write per run of adjacent blocks
+void fs_dcache_flush(dirCacheSlot *dir)
+{
+	uint64_t numDirectoryBlocks = fs_dir_numblocks();
+	char *buffer = fs_dir_buffer();
+	uint64_t i = 0;
+	while (dir->dirtyBlocks != 0 && i < numDirectoryBlocks) {
+		if ((dir->dirtyBlocks & ((uint64_t) 1 << i)) == 0) {
+			i++;
+			continue;
+		}
+		uint64_t end = i;
+		while (end < numDirectoryBlocks && (dir->dirtyBlocks & ((uint64_t) 1 << end))) {
+			fs_dcache_encode(dir, end, buffer + end * fsVCB.blockSize);
+			end++;
+		}
+		fs_lba_write(buffer + i * fsVCB.blockSize,
+				 (end - i) * fsVCB.numLBAPerBlock,
+				 dir->location + i * fsVCB.numLBAPerBlock);
+		fsStats.dirBlockWrites += end - i;
+		i = end;
+	}
+	dir->dirtyBlocks = 0;
+}
+
+void fs_dcache_read(dirCacheSlot *slot, uint64_t location)
+{
+	uint64_t numDirectoryBlocks = fs_dir_numblocks();
+	if (slot->entries == NULL) {
+		slot->entries = calloc(DIRMAX_ENTRIES, sizeof(directoryEntry));
+		fsStats.heapAllocs++;
+	}
+	memset(slot->entries, 0, DIRMAX_ENTRIES * sizeof(directoryEntry));
+	memset(slot->entryBlock, 0, sizeof(slot->entryBlock));
+	memset(slot->entryLen, 0, sizeof(slot->entryLen));
+	memset(slot->blockUsed, 0, sizeof(slot->blockUsed));
+	slot->location = location;
+
+	// "." in the first block tells how many blocks hold records
+	char *buffer = fs_dir_buffer();
+	int blocksUsed = 1;
+	fs_lba_read(buffer, fsVCB.numLBAPerBlock, location);
+	int n = fs_block_decode(buffer, slot->entries, DIRMAX_ENTRIES, &blocksUsed);
+	if (blocksUsed < 1 || blocksUsed > numDirectoryBlocks) {
+		blocksUsed = 1;
+	}
+	if (blocksUsed > 1) {
+		fs_lba_read(buffer + fsVCB.blockSize, (blocksUsed - 1) * fsVCB.numLBAPerBlock,
+				location + fsVCB.numLBAPerBlock);
+	}
+	fsStats.dirLoads++;
+	fsStats.dirBlockReads += blocksUsed;
+
+	for (int b = 1; b < blocksUsed; b++) {
+		int first = n;
+		n += fs_block_decode(buffer + b * fsVCB.blockSize, &slot->entries[n],
+							 DIRMAX_ENTRIES - n, NULL);
+		for (int i = first; i < n; i++) {
+			slot->entryBlock[i] = b;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		slot->entryLen[i] = fs_entry_record_size(slot, i);
+		slot->blockUsed[slot->entryBlock[i]] += slot->entryLen[i];
+	}
+
+	// build filter and arrays of names in use
+	memset(slot->nameFilter, 0, sizeof(slot->nameFilter));
+	memset(slot->nameHash, 0, sizeof(slot->nameHash));
+	memset(slot->entryType, 0, sizeof(slot->entryType));
+	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
+		fs_dcache_index(slot, i);
+		if (DE_IS_NAMED(slot->entries[i].type)) {
+			fs_bloom_add(slot->nameFilter, slot->nameHash[i]);
+		}
+	}
+}
+
+// borrow the slot of the directory starting at LBA location
+dirCacheSlot *fs_dcache_get(uint64_t location)
+{
+	dirCacheSlot *victim = NULL;
+	for (int i = 0; i < DCACHE_SLOTS; i++) {
+		dirCacheSlot *slot = &fsDirCache[i];
+		if (slot->location == location) {
+			slot->refCount++;
+			slot->lastUsed = ++fsDirCacheClock;
+			return slot;
+		}
+		if (slot->refCount == 0
+			&& (victim == NULL || slot->lastUsed < victim->lastUsed)) {
+			victim = slot;
+		}
+	}
+
+	// a directory loaded while every slot was in use keeps its transient
+	// slot until released, so there is never a second copy of it
+	for (dirCacheSlot *slot = fsDirTransient; slot != NULL;
+		 slot = slot->nextTransient) {
+		if (slot->location == location) {
+			slot->refCount++;
+			slot->lastUsed = ++fsDirCacheClock;
+			return slot;
+		}
+	}
+
+	if (victim == NULL) {
+		// every slot is in use
+		if (posix_memalign((void **) &victim, 32, sizeof(dirCacheSlot)) != 0) {
+			fprintf(stderr, "ERROR(%s): out of memory\n", __func__);
+			exit(1);
+		}
+		memset(victim, 0, sizeof(dirCacheSlot));
+		victim->transient = 1;
+		victim->nextTransient = fsDirTransient;
+		fsDirTransient = victim;
+		fsStats.heapAllocs++;
+	}
+	else if (victim->location != 0) {
+		// write back changes still deferred by a batch
+		fs_dcache_flush(victim);
+	}
+	fs_dcache_read(victim, location);
+	victim->refCount = 1;
+	victim->lastUsed = ++fsDirCacheClock;
+	return victim;
+}
+
+// borrow one more reference to a slot already borrowed
+dirCacheSlot *fs_dcache_hold(dirCacheSlot *slot)
+{
+	slot->refCount++;
+	slot->lastUsed = ++fsDirCacheClock;
+	return slot;
+}
+
+void fs_dcache_put(dirCacheSlot *slot)
+{
+	slot->refCount--;
+	if (slot->refCount == 0 && slot->transient) {
+		dirCacheSlot **link = &fsDirTransient;
+		while (*link != slot) {
+			link = &(*link)->nextTransient;
+		}
+		*link = slot->nextTransient;
+		fs_dcache_flush(slot);
+		free(slot->entries);
+		free(slot);
+	}
+}
+
+void fs_dcache_release(void)
+{
+	FS_DIR_LOCK();
+	if (fsCwdSlot != NULL) {
+		fs_dcache_put(fsCwdSlot);
+		fsCwdSlot = NULL;
+	}
+	for (int i = 0; i < DCACHE_SLOTS; i++) {
+		if (fsDirCache[i].location != 0) {
+			fs_dcache_flush(&fsDirCache[i]);
+		}
+		free(fsDirCache[i].entries);
+		memset(&fsDirCache[i], 0, sizeof(dirCacheSlot));
+	}
+	free(fsDirBuffer);
+	fsDirBuffer = NULL;
+}
+
+void fs_batch_begin(void)
+{
+	FS_DIR_LOCK();
+	fsBatchDepth++;
+}
+
+void fs_batch_end(void)
+{
+	FS_DIR_LOCK();
+	if (fsBatchDepth == 0 || --fsBatchDepth > 0) {
+		return;
+	}
+	for (int i = 0; i < DCACHE_SLOTS; i++) {
+		if (fsDirCache[i].location != 0) {
+			fs_dcache_flush(&fsDirCache[i]);
+		}
+	}
+}
+
+// forget a directory whose blocks are being freed
+void fs_dcache_invalidate(uint64_t location)
+{
+	for (int i = 0; i < DCACHE_SLOTS; i++) {
+		if (fsDirCache[i].location == location) {
+			// changes to a removed directory are dropped
+			fsDirCache[i].location = 0;
+			fsDirCache[i].dirtyBlocks = 0;
+		}
+	}
+	for (dirCacheSlot *slot = fsDirTransient; slot != NULL;
+		 slot = slot->nextTransient) {
+		if (slot->location == location) {
+			slot->location = 0;
+			slot->dirtyBlocks = 0;
+		}
+	}
+}
+
+// record name as added to directory: update its filter and drop any
+// cached miss for it
+void fs_dir_add_name(dirCacheSlot *dir, const char *name)
+{
+	uint32_t hash = fs_name_hash(name);
+	fs_bloom_add(dir->nameFilter, hash);
+
+	negCacheEntry *slot = fs_negcache_slot(dir->location, hash);
+	if (fs_negcache_match(slot, dir->location, hash, name, DE_NAME_MAXLEN)) {
+		memset(slot, 0, sizeof(negCacheEntry));
+	}
+}
+
+// find the first len characters of name among entries in use
+directoryEntry *fs_dcache_find(dirCacheSlot *dir, const char *name, size_t len)
+{
+	fsStats.lookups++;
+
+	// known miss
+	uint32_t hash = fs_name_hashn(name, len);
+	negCacheEntry *slot = fs_negcache_slot(dir->location, hash);
+	if (fs_negcache_match(slot, dir->location, hash, name, len)) {
+		fsStats.negCacheHits++;
+		return NULL;
+	}
+
+	// definite miss
+	if (!fs_bloom_maybe(dir->nameFilter, hash)) {
+		fsStats.bloomRejects++;
+		return NULL;
+	}
+
+	fsStats.entryScans++;
+	directoryEntry *entries = dir->entries;
+	if (fsScanMode == FS_SCAN_LINEAR) {
+		for (int i = 0; i < DIRMAX_ENTRIES; i++) {
+			if (!DE_IS_NAMED(entries[i].type)) {
+				continue;
+			}
+			if (fs_name_equal(entries[i].name, name, len)) {
+				return &entries[i];
+			}
+		}
+	}
+	else {
+		// full compare only where the hash matched
+		for (int base = 0; base < DIRMAX_ENTRIES_ALIGNED; base += 32) {
+			uint32_t mask = fs_hash_match32(&dir->nameHash[base], hash);
+			while (mask != 0) {
+				int i = base + __builtin_ctz(mask);
+				mask &= mask - 1;
+				if (i < DIRMAX_ENTRIES && DE_IS_NAMED(dir->entryType[i])
+					&& fs_name_equal(entries[i].name, name, len)) {
+					return &entries[i];
+				}
+			}
+		}
+	}
+
+	// remember the miss
+	fsStats.bloomFalsePositives++;
+	slot->dirLocation = dir->location;
+	slot->hash = hash;
+	memset(slot->name, 0, sizeof(slot->name));
+	memcpy(slot->name, name, len < DE_NAME_MAXLEN ? len : DE_NAME_MAXLEN);
+	return NULL;
+}
+
+//
+// Path resolution
+//
+// Paths are walked one component at a time in place, without copying
+// or tokenizing them. "." and ".." are the first two entries of every
+// directory, so they resolve through the entries like any other name.
+//
+
+// resolve pathname starting from directory dir (a borrowed slot, which is
+// released). Returns the entry named by the last component and stores the
+// borrowed slot of the directory holding it in *holder. A path without
+// components names entry "." of the starting directory.
+directoryEntry *fs_resolve_at(dirCacheSlot *dir, const char *pathname,
+							  dirCacheSlot **holder)
+{
+	directoryEntry *entry = &dir->entries[0];
+	const char *p = pathname;
+
+	while (1) {
+		while (*p == '/') {
+			p++;
+		}
+		if (*p == 0) {
+			break;
+		}
+		const char *name = p;
+		while (*p != 0 && *p != '/') {
+			p++;
+		}
+		size_t len = p - name;
+
+		// step into the directory named so far
+		if (entry->type != DE_TYPE_DIRECTORY) {
+			fs_dcache_put(dir);
+			return NULL;
+		}
+		if (entry != &dir->entries[0]) {
+			dirCacheSlot *next = fs_dcache_get(entry->location * fsVCB.numLBAPerBlock);
+			fs_dcache_put(dir);
+			dir = next;
+		}
+
+		if (len == 1 && name[0] == '.') {
+			entry = &dir->entries[0];
+		}
+		else if (len == 2 && name[0] == '.' && name[1] == '.') {
+			entry = &dir->entries[1];
+		}
+		else {
+			entry = fs_dcache_find(dir, name, len);
+			if (entry == NULL) {
+				fs_dcache_put(dir);
+				return NULL;
+			}
+		}
+	}
+
+	*holder = dir;
+	return entry;
+}
+
+directoryEntry *fs_resolve(const char *pathname, dirCacheSlot **holder)
+{
+	if (pathname[0] == '/') {
+		dirCacheSlot *root = fs_dcache_get(fsVCB.rootDirStart * fsVCB.numLBAPerBlock);
+		return fs_resolve_at(root, pathname, holder);
+	}
+
+	// relative path starts from current working directory
+	return fs_resolve_at(fs_dcache_hold(fsCwdSlot), pathname, holder);
+}
+
+// resolve pathname to a directory and borrow its slot
+dirCacheSlot *fs_resolve_dir(const char *pathname)
+{
+	dirCacheSlot *holder;
+	directoryEntry *entry = fs_resolve(pathname, &holder);
+	if (entry == NULL) {
+		return NULL;
+	}
+	if (entry->type != DE_TYPE_DIRECTORY) {
+		fs_dcache_put(holder);
+		return NULL;
+	}
+	dirCacheSlot *dir = fs_dcache_get(entry->location * fsVCB.numLBAPerBlock);
+	fs_dcache_put(holder);
+	return dir;
+}
+
+// resolve the directory holding the last component of pathname and
+// borrow its slot. *name and *len give the last component, which is not
+// resolved.
+dirCacheSlot *fs_resolve_parent(const char *pathname, const char **name, size_t *len)
+{
+	const char *end = pathname + strlen(pathname);
+	while (end > pathname && end[-1] == '/') {
+		end--;
+	}
+	const char *last = end;
+	while (last > pathname && last[-1] != '/') {
+		last--;
+	}
+	*name = last;
+	*len = end - last;
+
+	char parent[CWDMAX_LEN];
+	size_t parentLen = last - pathname;
+	if (parentLen >= sizeof(parent)) {
+		return NULL;
+	}
+	memcpy(parent, pathname, parentLen);
+	parent[parentLen] = 0;
+	if (parentLen == 0) {
+		// "/" is its own parent
+		strcpy(parent, (pathname[0] == '/') ? "/" : ".");
+	}
+	return fs_resolve_dir(parent);
+}
+
+// whether the directory starting at block ancestor is dir or one of the
+// directories above it
+int fs_dir_is_ancestor(dirCacheSlot *dir, uint64_t ancestor)
+{
+	uint64_t block = dir->entries[0].location;
+	while (block != ancestor) {
+		if (block == fsVCB.rootDirStart) {
+			return 0;
+		}
+		dirCacheSlot *parent = fs_dcache_get(block * fsVCB.numLBAPerBlock);
+		block = parent->entries[1].location;
+		fs_dcache_put(parent);
+	}
+	return 1;
+}
+
+// write back modified blocks of dir, now or at the end of the batch
+void fs_dcache_store(dirCacheSlot *dir)
+{
+	if (fsBatchDepth == 0) {
+		fs_dcache_flush(dir);
+	}
+}
+
+// write back modified blocks of dir now, even within a batch: an entry
+// detached from a chain must be on disk before the chain is orphaned, or
+// after a crash the orphan is freed while the entry still uses it
+void fs_dcache_commit(dirCacheSlot *dir)
+{
+	fs_dcache_flush(dir);
+}
+
+//
+// Directory cursors
+//
+// An fdDir does not hold the directory. It keeps the entries decoded from
+// a batch of FS_DIR_BATCH_BLOCKS blocks and moves on to the next batch
+// when they are used up, so an open directory costs one batch of memory
+// and a scan that stops early reads only the blocks it passed through.
+// Blocks past the last one holding records are not read at all.
+//
+
+#define FS_DIR_BATCH_BLOCKS	1
+
+// open a cursor on the directory starting at LBA location
+fdDir * fs_load_dirdata(uint64_t startLocationLBA)
+{
+	fdDir *dirData = calloc(1, sizeof(fdDir));
+	dirData->directoryStartLocation = startLocationLBA;
+	dirData->dirEntryPosition = 0;
+	dirData->d_reclen = sizeof(directoryEntry);
+
+	// every record may be followed by an inline entry, but however large
+	// the blocks a directory never has more than DIRMAX_ENTRIES entries
+	dirData->batchSize = 2 * FS_DIR_BATCH_BLOCKS * fsVCB.blockSize
+						 / DE_RECORD_SIZE(1, 0);
+	if (dirData->batchSize > DIRMAX_ENTRIES) {
+		dirData->batchSize = DIRMAX_ENTRIES;
+	}
+	dirData->batchStart = 0;
+	dirData->batchCount = -1;
+	dirData->dirBlocks = 1;
+	dirData->entries = malloc(dirData->batchSize * sizeof(directoryEntry));
+	fsStats.heapAllocs += 2;
+	return dirData;
+}
+
+// open the directory named by entry
+fdDir * fs_opendir_entry(directoryEntry *entry)
+{
+	if (entry->type != DE_TYPE_DIRECTORY) {
+		return NULL;
+	}
+	return fs_load_dirdata(entry->location * fsVCB.numLBAPerBlock);
+}
+
+// find slot of a cached directory, without loading it
+dirCacheSlot *fs_dcache_lookup(uint64_t location)
+{
+	for (int i = 0; i < DCACHE_SLOTS; i++) {
+		if (fsDirCache[i].location == location) {
+			return &fsDirCache[i];
+		}
+	}
+	for (dirCacheSlot *slot = fsDirTransient; slot != NULL;
+		 slot = slot->nextTransient) {
+		if (slot->location == location) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+// fill the cursor with the entries of the batch starting at block first,
+// from the directory cache if the directory is cached, else from disk
+void fs_dir_fill_batch(fdDir *dirp, int first)
+{
+	directoryEntry *entries = dirp->entries;
+	int count = 0;
+
+	dirCacheSlot *slot = fs_dcache_lookup(dirp->directoryStartLocation);
+	if (slot != NULL) {
+		for (int i = 0; i < DIRMAX_ENTRIES && count < dirp->batchSize; i++) {
+			if (slot->entryLen[i] > 0 && slot->entryBlock[i] >= first
+				&& slot->entryBlock[i] < first + FS_DIR_BATCH_BLOCKS) {
+				memcpy(&entries[count++], &slot->entries[i], sizeof(directoryEntry));
+			}
+		}
+		dirp->dirBlocks = fs_dir_blocks_used(slot);
+	}
+	else {
+		int numBlocks = FS_DIR_BATCH_BLOCKS;
+		if (first + numBlocks > fs_dir_numblocks()) {
+			numBlocks = fs_dir_numblocks() - first;
+		}
+		char *buffer = fs_dir_buffer();
+		fs_lba_read(buffer, numBlocks * fsVCB.numLBAPerBlock,
+				dirp->directoryStartLocation + first * fsVCB.numLBAPerBlock);
+		fsStats.dirBlockReads += numBlocks;
+		for (int b = 0; b < numBlocks; b++) {
+			count += fs_block_decode(buffer + b * fsVCB.blockSize, &entries[count],
+									 dirp->batchSize - count,
+									 (first + b == 0) ? &dirp->dirBlocks : NULL);
+		}
+	}
+	dirp->batchStart = first;
+	dirp->batchCount = count;
+	dirp->dirEntryPosition = 0;
+}
+
+// next entry in use at the cursor, NULL at end of directory
+directoryEntry *fs_dir_next(fdDir *dirp)
+{
+	while (1) {
+		if (dirp->batchCount < 0) {
+			fs_dir_fill_batch(dirp, 0);
+		}
+		else if (dirp->dirEntryPosition >= dirp->batchCount) {
+			int next = dirp->batchStart + FS_DIR_BATCH_BLOCKS;
+			if (next >= dirp->dirBlocks) {
+				return NULL;
+			}
+			fs_dir_fill_batch(dirp, next);
+		}
+		if (dirp->dirEntryPosition >= dirp->batchCount) {
+			continue;
+		}
+		directoryEntry *entries = dirp->entries;
+		directoryEntry *entry = &entries[dirp->dirEntryPosition];
+
+		// next position for next fs_readdir
+		dirp->dirEntryPosition++;
+		if (DE_IS_NAMED(entry->type)) {
+			return entry;
+		}
+	}
+}
+
+// Key directory functions
+
+// create directory named by the first len characters of name in parentDir
+int fs_dir_mkdir(dirCacheSlot *parentDir, const char *name, size_t len)
+{
+	if (len == 0 || len > DE_NAME_MAXLEN) {
+		fprintf(stderr, "ERROR(%s): bad name \"%.*s\"\n", __func__, (int) len, name);
+		return -1;
+	}
 
-char fsCurrWorkDir[CWDMAX_LEN];
-fdDir *fsFdDirOpened = NULL;
+	directoryEntry *parentEntries = parentDir->entries;
 
-typedef struct {
-	char *path;
-	char *name;
-} pathnameInfo;
+	// find duplicate name in parent directory
+	if (fs_dcache_find(parentDir, name, len) != NULL) {
+		fprintf(stderr, "ERROR(%s): %.*s already exists\n", __func__, (int) len, name);
+		return -1;
+	}
 
-fdDir * _fs_opendir(const char *pathname);
-int _fs_closedir(fdDir *dirp);
+	// find unused entry with room for its record
+	int i = fs_dir_alloc_entry(parentDir, len, 0);
+	if (i < 0) {
+		fprintf(stderr, "ERROR(%s): directory is full\n", __func__);
+		return -1;
+	}
+	directoryEntry *newEntry = &parentEntries[i];
+
+	// allocate blocks for storing directory and write "." and "..". The
+	// blocks of a directory are read and written by LBA, so they must follow
+	// each other.
+	uint64_t startBlock = allocateContiguousBlocks(fs_dir_numblocks(), fs_dir_goal());
+	if (startBlock == 0) {
+		fprintf(stderr, "ERROR(%s): no contiguous space for a directory\n", __func__);
+		return -1;
+	}
+	fs_dir_write_new(startBlock, parentEntries[0].location);
+
+	//
+	// update parent directory
+	//
+
+	memset(newEntry->name, 0, sizeof(newEntry->name));
+	memcpy(newEntry->name, name, len);
+	newEntry->type = DE_TYPE_DIRECTORY;
+	newEntry->location = startBlock;
+	newEntry->size = DIR_SIZE;
+	newEntry->dateCreated = time(NULL);
+	newEntry->lastModified = newEntry->dateCreated;
+	newEntry->lastOpened = newEntry->dateCreated;
+	fs_dir_add_name(parentDir, newEntry->name);
+	fs_dcache_dirty(parentDir, newEntry);
+
+	fs_dcache_store(parentDir);
+	return 0;
+}
 
-void fs_free_pathname_info(pathnameInfo *info)
+int fs_mkdir(const char *pathname, mode_t mode)
 {
-	if (info->path != NULL) {
-		free(info->path);
-		info->path = NULL;
+	FS_DIR_LOCK();
+	const char *name;
+	size_t len;
+	dirCacheSlot *parentDir = fs_resolve_parent(pathname, &name, &len);
+	if (parentDir == NULL) {
+		return -1;
 	}
-	if (info->name != NULL) {
-		free(info->name);
-		info->name = NULL;
+	int ret = fs_dir_mkdir(parentDir, name, len);
+	fs_dcache_put(parentDir);
+	return ret;
+}
+
+int fs_mkdirat(fdDir *dirp, const char *name, mode_t mode)
+{
+	FS_DIR_LOCK();
+	if (strchr(name, '/') != NULL) {
+		return -1;
 	}
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	int ret = fs_dir_mkdir(dir, name, strlen(name));
+	fs_dcache_put(dir);
+	return ret;
 }
 
-pathnameInfo fs_parse_pathname(char *pathname)
+// remove the entry named by the first len characters of name from dir,
+// which must be of type (or any type if 0). Directories must be empty.
+int fs_dir_remove(dirCacheSlot *dir, const char *name, size_t len, int type)
 {
-	// printf("DBG(%s) pathname=%s\n", __func__, pathname);
-	pathnameInfo info;
-	info.path = strdup(pathname);
-	info.name = NULL;
+	if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+		fprintf(stderr, "ERROR: cannot remove \"%.*s\"\n", (int) len, name);
+		return -1;
+	}
+	directoryEntry *entry = fs_dcache_find(dir, name, len);
+	if (entry == NULL || (type != 0 && entry->type != type)) {
+		fprintf(stderr, "ERROR: cannot find \"%.*s\"\n", (int) len, name);
+		return -1;
+	}
 
-	// root directory
-	if (strcmp(pathname, "/") == 0) {
-		return info;
+	if (entry->type == DE_TYPE_DIRECTORY) {
+		// check whether directory is empty
+		// it is empty if it only has . and ..
+		dirCacheSlot *dirData = fs_dcache_get(entry->location * fsVCB.numLBAPerBlock);
+		for (int i = 2; i < DIRMAX_ENTRIES; i++) {
+			if (dirData->entries[i].type != DE_TYPE_UNUSED) {
+				// return -1 if any entry (except . and ..) is used
+				fprintf(stderr, "ERROR:\"%.*s\" is not empty\n", (int) len, name);
+				fs_dcache_put(dirData);
+				return -1;
+			}
+		}
+		if (dirData->location == fsCwdSlot->location) {
+			fprintf(stderr, "ERROR:\"%.*s\" is the working directory\n", (int) len, name);
+			fs_dcache_put(dirData);
+			return -1;
+		}
+		fs_dcache_invalidate(dirData->location);
+		fs_dcache_put(dirData);
 	}
 
-	// remove trailing '/'
-	if (info.path[strlen(info.path) - 1] == '/') {
-		info.path[strlen(info.path) - 1] = 0;
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (record != NULL) {
+		memset(record, 0, sizeof(directoryEntry));
+		fs_dcache_dirty(dir, (directoryEntry *) record);
 	}
 
-	// split pathname by right-most '/'
-	char *p = strrchr(info.path, '/');
-	if (p != NULL) {
-		p[0] = 0;
-		info.name = strdup(p+1);
+	// clear entry, then detach its blocks
+	uint64_t location = entry->location;
+	memset(entry, 0, sizeof(directoryEntry));
+	fs_dcache_dirty(dir, entry);
+	if (location != 0) {
+		fs_dcache_commit(dir);
+		deferFreeBlocks(location);
 	}
 	else {
-		// filename only
-		info.name = info.path;
-		info.path = NULL;
+		fs_dcache_store(dir);
 	}
-
-	// printf("DBG(%s) path=%s name=%s\n", __func__, info.path, info.name);
-	return info;
+	return 0;
 }
 
-fdDir * fs_load_dirdata(uint64_t startLocationLBA)
+// remove the entry of pathname, of type (or any type if 0)
+int fs_remove_path(const char *pathname, int type)
 {
-	fdDir *dirData = calloc(1, sizeof(fdDir));
-	dirData->directoryStartLocation = startLocationLBA;
-	dirData->dirEntryPosition = 0;
-	dirData->d_reclen = sizeof(directoryEntry);
-
-	// read directory entries
-	size_t sizeDirectory = sizeof(directoryEntry) * DIRMAX_ENTRIES;
-	int numDirectoryBlocks = (sizeDirectory + fsVCB.blockSize - 1) / fsVCB.blockSize;
-	dirData->entries = calloc(numDirectoryBlocks, fsVCB.blockSize);
-	LBAread(dirData->entries, numDirectoryBlocks * fsVCB.numLBAPerBlock,
-			dirData->directoryStartLocation);
+	const char *name;
+	size_t len;
+	dirCacheSlot *dir = fs_resolve_parent(pathname, &name, &len);
+	if (dir == NULL) {
+		fprintf(stderr, "ERROR: cannot find \"%s\"\n", pathname);
+		return -1;
+	}
+	int ret = fs_dir_remove(dir, name, len, type);
+	fs_dcache_put(dir);
+	return ret;
+}
 
-	return dirData;
+int fs_rmdir(const char *pathname)
+{
+	FS_DIR_LOCK();
+	return fs_remove_path(pathname, DE_TYPE_DIRECTORY);
 }
 
-void fs_store_dirdata(fdDir *dir)
+int fs_remove(fdDir *dirp, const char *name)
 {
-	uint64_t sizeDirectory = DIRMAX_ENTRIES * sizeof(directoryEntry);
-	uint64_t numDirectoryBlocks = (sizeDirectory + fsVCB.blockSize - 1) / fsVCB.blockSize;
-	LBAwrite(dir->entries, numDirectoryBlocks * fsVCB.numLBAPerBlock,
-			 dir->directoryStartLocation);
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	int ret = fs_dir_remove(dir, name, strlen(name), 0);
+	fs_dcache_put(dir);
+	return ret;
 }
 
-// Key directory functions
+int fs_unlinkat(fdDir *dirp, const char *name, int flags)
+{
+	FS_DIR_LOCK();
+	if (strchr(name, '/') != NULL) {
+		return -1;
+	}
+	int type = (flags & FS_AT_REMOVEDIR) ? DE_TYPE_DIRECTORY : DE_TYPE_FILE;
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	int ret = fs_dir_remove(dir, name, strlen(name), type);
+	fs_dcache_put(dir);
+	return ret;
+}
 
-int fs_mkdir(const char *pathname, mode_t mode)
+// remove the entry named by the first len characters of name from dir
+// together with everything below it. The subtree is walked once to
+// gather the chains of its files and directories, which are then freed
+// together, and only dir itself is written back.
+int fs_dir_remove_tree(dirCacheSlot *dir, const char *name, size_t len,
+		struct fs_rmtree_stats *stats)
 {
-	fdDir *parentDir;
-	if (strchr(pathname, '/') == NULL) {
-		parentDir = _fs_opendir(fsCurrWorkDir);
+	if (len == 0 || (len == 1 && name[0] == '.')
+		|| (len == 2 && name[0] == '.' && name[1] == '.')) {
+		fprintf(stderr, "ERROR: cannot remove \"%.*s\"\n", (int) len, name);
+		return -1;
 	}
-	else {
+	directoryEntry *entry = fs_dcache_find(dir, name, len);
+	if (entry == NULL) {
+		fprintf(stderr, "ERROR: cannot find \"%.*s\"\n", (int) len, name);
+		return -1;
+	}
+	if (entry->type == DE_TYPE_DIRECTORY && fs_dir_is_ancestor(fsCwdSlot, entry->location)) {
+		fprintf(stderr, "ERROR:\"%.*s\" holds the working directory\n", (int) len, name);
 		return -1;
 	}
 
-	directoryEntry *parentEntries = parentDir->entries;
+	int numHeads = 0;
+	int maxHeads = 64;
+	uint64_t *heads = malloc(maxHeads * sizeof(uint64_t));
+	int numDirs = 0;
+	int maxDirs = 16;
+	uint64_t *dirs = malloc(maxDirs * sizeof(uint64_t));
+	uint64_t entries = 1;
 
-	// find duplicate name in parent directory
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		if (strcmp(parentEntries[i].name, pathname) == 0) {
-			fprintf(stderr, "ERROR(%s): %s already exists\n", __func__, pathname);
-			return -1;
-		}
+	if (entry->location != 0) {
+		heads[numHeads++] = entry->location;
 	}
-
-	// find unused entries in parent directory
-	directoryEntry *newEntry = NULL;
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		if (parentEntries[i].type == DE_TYPE_UNUSED) {
-			newEntry = &parentEntries[i];
-			break;
+	if (entry->type == DE_TYPE_DIRECTORY) {
+		dirs[numDirs++] = entry->location;
+	}
+	while (numDirs > 0) {
+		uint64_t location = dirs[--numDirs] * fsVCB.numLBAPerBlock;
+		dirCacheSlot *sub = fs_dcache_get(location);
+		for (int i = 2; i < DIRMAX_ENTRIES; i++) {
+			directoryEntry *child = &sub->entries[i];
+			if (!DE_IS_NAMED(child->type)) {
+				continue;
+			}
+			entries++;
+			if (child->location == 0) {
+				continue;
+			}
+			if (numHeads == maxHeads) {
+				maxHeads *= 2;
+				heads = realloc(heads, maxHeads * sizeof(uint64_t));
+			}
+			heads[numHeads++] = child->location;
+			if (child->type == DE_TYPE_DIRECTORY) {
+				if (numDirs == maxDirs) {
+					maxDirs *= 2;
+					dirs = realloc(dirs, maxDirs * sizeof(uint64_t));
+				}
+				dirs[numDirs++] = child->location;
+			}
 		}
+		// changes to a removed directory are dropped
+		fs_dcache_invalidate(location);
+		fs_dcache_put(sub);
 	}
-	if (newEntry == NULL) {
-		return -1;
+	free(dirs);
+
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (record != NULL) {
+		memset(record, 0, sizeof(directoryEntry));
+		fs_dcache_dirty(dir, (directoryEntry *) record);
 	}
+	memset(entry, 0, sizeof(directoryEntry));
+	fs_dcache_dirty(dir, entry);
+	fs_dcache_commit(dir);
 
-	// compute size of directory
-	uint64_t sizeDirectory = DIRMAX_ENTRIES * sizeof(directoryEntry);
+	uint64_t blocks = freeAllocatedChains(heads, numHeads);
+	free(heads);
 
-	// allocated memory for directory
-	uint64_t numDirectoryBlocks = (sizeDirectory + fsVCB.blockSize - 1) / fsVCB.blockSize;
-	sizeDirectory = numDirectoryBlocks * fsVCB.blockSize;
-	directoryEntry *entries = calloc(numDirectoryBlocks, fsVCB.blockSize);
+	if (stats != NULL) {
+		stats->entries = entries;
+		stats->blocks = blocks;
+	}
+	return 0;
+}
 
-	// fill entries in directory
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		memset(entries[i].name, 0, sizeof(entries[i].name));
-		entries[i].type = DE_TYPE_UNUSED;
-		entries[i].location = 0;
-		entries[i].size = 0;
-		entries[i].lastModified = 0;
-		entries[i].lastOpened = 0;
-		entries[i].dateCreated = 0;
+int fs_rmtree(const char *pathname, struct fs_rmtree_stats *stats)
+{
+	FS_DIR_LOCK();
+	const char *name;
+	size_t len;
+	dirCacheSlot *dir = fs_resolve_parent(pathname, &name, &len);
+	if (dir == NULL) {
+		fprintf(stderr, "ERROR: cannot find \"%s\"\n", pathname);
+		return -1;
 	}
+	int ret = fs_dir_remove_tree(dir, name, len, stats);
+	fs_dcache_put(dir);
+	return ret;
+}
 
-	// allocate blocks for storing directory
-	uint64_t startBlock = allocateFreeBlocks(numDirectoryBlocks);
+// Directory iteration functions
 
-	//
-	// fill first and second entries
-	//
+fdDir * _fs_opendir(const char *pathname)
+{
+	dirCacheSlot *holder;
+	directoryEntry *entry = fs_resolve(pathname, &holder);
+	if (entry == NULL) {
+		return NULL;
+	}
+	fdDir *dirData = fs_opendir_entry(entry);
+	fs_dcache_put(holder);
+	return dirData;
+}
 
-	// 1st entry
-	entries[0].name[0] = '.';
-	entries[0].type = DE_TYPE_DIRECTORY;
-	entries[0].location = startBlock;
-	entries[0].size = sizeDirectory;
-	entries[0].dateCreated = time(NULL);
-	entries[0].lastModified = entries[0].dateCreated;
-	entries[0].lastOpened = entries[0].dateCreated;
-
-	// 2nd entry
-	memcpy(&entries[1], &entries[0], sizeof(directoryEntry));
-	entries[1].name[1] = '.';
-	// point to parent location
-	entries[1].location = parentEntries[0].location;
+fdDir * fs_opendir(const char *pathname)
+{
+	FS_DIR_LOCK();
+	fdDir *dirData = _fs_opendir(pathname);
+	fsFdDirOpened = dirData;
+	return dirData;
+}
 
-	// write directory
-	char *buffer = (char *) entries;
-	for (int i = 0; i < numDirectoryBlocks; i++) {
-		writeBlock(buffer, startBlock + i);
-		buffer += fsVCB.blockSize;
+void fs_fill_iteminfo(struct fs_diriteminfo *item, directoryEntry *entry)
+{
+	memset(item, 0, sizeof(struct fs_diriteminfo));
+	strncpy(item->d_name, entry->name, sizeof(item->d_name) - 1);
+	switch (entry->type) {
+		case DE_TYPE_DIRECTORY:
+			item->fileType = FT_DIRECTORY;
+			break;
+		case DE_TYPE_FILE:
+			item->fileType = FT_REGFILE;
+			break;
+		default:
+			fprintf(stderr, "ERROR(%s): unknown file type %d\n", __func__, entry->type);
+			break;
 	}
-	free(entries);
+	item->startLocationLBA = entry->location * fsVCB.numLBAPerBlock;
+	item->size = entry->size;
+	item->mapBlocks = entry->mapBlocks;
+}
 
-	//
-	// update parent directory
-	//
+struct fs_diriteminfo *fs_readdir(fdDir *dirp)
+{
+	FS_DIR_LOCK();
+	directoryEntry *entry = fs_dir_next(dirp);
+	if (entry == NULL) {
+		return NULL;
+	}
 
-	strncpy(newEntry->name, pathname, DE_NAME_MAXLEN);
-	newEntry->type = DE_TYPE_DIRECTORY;
-	newEntry->location = startBlock;
-	newEntry->size = sizeDirectory;
-	newEntry->dateCreated = time(NULL);
-	newEntry->lastModified = newEntry->dateCreated;
-	newEntry->lastOpened = newEntry->dateCreated;
+	// copy information
+	fs_fill_iteminfo(&dirp->itemInfo, entry);
+	return &dirp->itemInfo;
+}
 
-	LBAwrite(parentDir->entries, numDirectoryBlocks * fsVCB.numLBAPerBlock,
-			parentDir->directoryStartLocation);
+void fs_fill_stat(struct fs_stat *buf, directoryEntry *entry)
+{
+	buf->st_size = entry->size;
+	buf->st_blksize = fsVCB.blockSize;
+	// blocks taken, fewer than its size for a sparse file and more for a
+	// file with blocks reserved past its end
+	uint64_t blocks = (entry->size + fsVCB.blockSize - 1) / fsVCB.blockSize;
+	if (entry->location == 0) {
+		blocks = 0;
+	}
+	else if (entry->allocBlocks > 0) {
+		blocks = entry->allocBlocks;
+	}
+	buf->st_blocks = blocks * (fsVCB.blockSize / 512);
+	buf->st_accesstime = entry->lastOpened;
+	buf->st_modtime = entry->lastModified;
+	buf->st_createtime = entry->dateCreated;
+}
 
-	fs_closedir(parentDir);
+// status of the file or directory of entry, from "." for a directory
+void fs_fill_entry_stat(struct fs_stat *buf, directoryEntry *entry)
+{
+	if (entry->type == DE_TYPE_DIRECTORY) {
+		dirCacheSlot *self = fs_dcache_get(entry->location * fsVCB.numLBAPerBlock);
+		fs_fill_stat(buf, &self->entries[0]);
+		fs_dcache_put(self);
+	}
+	else {
+		fs_fill_stat(buf, entry);
+	}
+}
 
-	return(0);
+int fs_readdirplus(fdDir *dirp, struct fs_direntplus *buf, int count)
+{
+	FS_DIR_LOCK();
+	int n = 0;
+	directoryEntry *entry;
+	while (n < count && (entry = fs_dir_next(dirp)) != NULL) {
+		fs_fill_iteminfo(&buf[n].item, entry);
+		fs_fill_stat(&buf[n].st, entry);
+		n++;
+	}
+	return n;
 }
 
-int fs_rmdir(const char *pathname)
+struct fs_diriteminfo *fs_findentry(fdDir *dirp, const char *name)
 {
-	// basically the same as fs_delete()
-	// needs to check if empty
-	// it is empty if it only has . and ..
-	if (strchr(pathname, '/') != NULL) {
-		return -1;
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, name, strlen(name));
+	if (entry != NULL) {
+		fs_fill_iteminfo(&dirp->itemInfo, entry);
 	}
+	fs_dcache_put(dir);
+	return (entry != NULL) ? &dirp->itemInfo : NULL;
+}
 
-	// open current working directory
-	fdDir *parentDir = _fs_opendir(fsCurrWorkDir);
-	if (parentDir == NULL) {
+int fs_lookup(const char *path, struct fs_lookup_result *result)
+{
+	FS_DIR_LOCK();
+	memset(result, 0, sizeof(struct fs_lookup_result));
+
+	// one walk: the directory holding the last component, then the
+	// component itself
+	const char *name;
+	size_t len;
+	dirCacheSlot *dir = fs_resolve_parent(path, &name, &len);
+	if (dir == NULL) {
 		return -1;
 	}
+	if (len > DE_NAME_MAXLEN) {
+		fs_dcache_put(dir);
+		return FS_LOOKUP_TOOLONG;
+	}
+	result->parentLocation = dir->location;
 
-	// find directory to remove
-	directoryEntry *entries = parentDir->entries;
-	directoryEntry *entryToRemove = NULL;
-	for (int i = 2; i < DIRMAX_ENTRIES; i++) {
-		if (entries[i].type == DE_TYPE_UNUSED) {
-			continue;
-		}
-		if (strncmp(entries[i].name, pathname, sizeof(entries[i].name)) == 0) {
-			entryToRemove = &entries[i];
-			break;
-		}
+	// "name/" has to be a directory
+	int dirOnly = (len > 0 && name[len] == '/');
+	directoryEntry *entry;
+	if (len == 0) {
+		// root directory
+		entry = &dir->entries[0];
 	}
-	if (entryToRemove == NULL) {
-		fprintf(stderr, "ERROR: cannot find \"%s\"\n", pathname);
-		fs_closedir(parentDir);
+	else {
+		memcpy(result->item.d_name, name, len);
+		entry = fs_dcache_find(dir, name, len);
+	}
+	if (dirOnly && (entry == NULL || entry->type != DE_TYPE_DIRECTORY)) {
+		fs_dcache_put(dir);
+		return FS_LOOKUP_NOTDIR;
+	}
+	if (entry == NULL) {
+		fs_dcache_put(dir);
 		return -1;
 	}
-	
-	// check whether directory is empty
-	fdDir *dirData = fs_load_dirdata(entryToRemove->location * fsVCB.numLBAPerBlock);
-	if (dirData == NULL) {
-		fs_closedir(parentDir);
-	}
-	entries = dirData->entries;
-	for (int i = 2; i < DIRMAX_ENTRIES; i++) {
-		if (entries[i].type != DE_TYPE_UNUSED) {
-			// return -1 if any entry (except . and ..) is used
-			fprintf(stderr, "ERROR:\"%s\" is not empty\n", pathname);
-			fs_closedir(parentDir);
-			fs_closedir(dirData);
-			return -1;
-		}
+
+	fs_fill_iteminfo(&result->item, entry);
+	fs_fill_entry_stat(&result->st, entry);
+	fs_dcache_put(dir);
+	return 0;
+}
+
+int fs_statat(fdDir *dirp, const char *name, struct fs_stat *buf)
+{
+	FS_DIR_LOCK();
+	if (strchr(name, '/') != NULL) {
+		return -1;
 	}
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, name, strlen(name));
+	if (entry != NULL) {
+		fs_fill_entry_stat(buf, entry);
+	}
+	fs_dcache_put(dir);
+	return (entry != NULL) ? 0 : -1;
+}
 
-	// free allocated blocks and clear entry
-	freeAllocatedBlocks(entryToRemove->location);
-	memset(entryToRemove, 0, sizeof(directoryEntry));
+fdDir * fs_dupdir(fdDir *dirp)
+{
+	FS_DIR_LOCK();
+	return fs_load_dirdata(dirp->directoryStartLocation);
+}
 
-	// store directory data
-	fs_store_dirdata(parentDir);
+fdDir * fs_opendir_lookup(const struct fs_lookup_result *result)
+{
+	FS_DIR_LOCK();
+	if (result->item.fileType != FT_DIRECTORY) {
+		return NULL;
+	}
+	return fs_load_dirdata(result->item.startLocationLBA);
+}
 
-	fs_closedir(parentDir);
-	fs_closedir(dirData);
-	return 0;
+fdDir * fs_opendir_parent(const struct fs_lookup_result *result)
+{
+	FS_DIR_LOCK();
+	if (result->parentLocation == 0) {
+		return NULL;
+	}
+	return fs_load_dirdata(result->parentLocation);
 }
 
-// Directory iteration functions
+int _fs_closedir(fdDir *dirp)
+{
+	// free all the stuff from open
+	free(dirp->entries);
+	free(dirp);
+	return(0);
+}
 
-directoryEntry *fs_find_entry_atdir(fdDir *dirData, const char *name)
+int fs_closedir(fdDir *dirp)
 {
-	directoryEntry *entries = dirData->entries;
-	directoryEntry *subEntry = NULL;
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		if (strncmp(entries[i].name, name, DE_NAME_MAXLEN) == 0) {
-			subEntry = &entries[i];
+	FS_DIR_LOCK();
+	fsFdDirOpened = NULL;
+	return _fs_closedir(dirp);
+}
+
+// Misc directory functions
+
+char * fs_getcwd(char *pathname, size_t size)
+{
+	FS_DIR_LOCK();
+	if ((strlen(fsCurrWorkDir) + 1) >= size) {
+		return NULL;
+	}
+	strcpy(pathname, fsCurrWorkDir);
+	return pathname;
+}
+
+// apply pathname to the current working directory, giving the new
+// absolute path without "." and ".." components
+int fs_path_join(char *out, const char *pathname)
+{
+	const char *p = pathname;
+	size_t outLen;
+
+	if (pathname[0] == '/') {
+		outLen = 0;
+	}
+	else {
+		outLen = strlen(fsCurrWorkDir);
+		memcpy(out, fsCurrWorkDir, outLen);
+		if (outLen == 1) {
+			// root directory
+			outLen = 0;
+		}
+	}
+
+	while (1) {
+		while (*p == '/') {
+			p++;
+		}
+		if (*p == 0) {
 			break;
 		}
+		const char *name = p;
+		while (*p != 0 && *p != '/') {
+			p++;
+		}
+		size_t len = p - name;
+
+		if (len == 1 && name[0] == '.') {
+			continue;
+		}
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			// parent of root is still root
+			while (outLen > 0 && out[outLen - 1] != '/') {
+				outLen--;
+			}
+			if (outLen > 0) {
+				outLen--;
+			}
+			continue;
+		}
+		if (outLen + len + 2 > CWDMAX_LEN) {
+			return -1;
+		}
+		out[outLen++] = '/';
+		memcpy(out + outLen, name, len);
+		outLen += len;
+	}
+
+	if (outLen == 0) {
+		out[outLen++] = '/';
 	}
-	return subEntry;
+	out[outLen] = 0;
+	return 0;
 }
 
-fdDir * fs_opendirat(fdDir *dirData, const char *pathname)
+int fs_setcwd(char *pathname)
 {
-	// directoryEntry *entries = dirData->entries;
-	// directoryEntry *subEntry = NULL;
-	// for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-	// 	if (strncmp(entries[i].name, pathname, DE_NAME_MAXLEN) == 0) {
-	// 		if (entries[i].type == DE_TYPE_DIRECTORY) {
-	// 			subEntry = &entries[i];
-	// 			break;
-	// 		}
-	// 	}
-	// }
-	directoryEntry *entry = fs_find_entry_atdir(dirData, pathname);
+	FS_DIR_LOCK();
+	// printf("%s: pathname=%s\n", __func__, pathname);
+	if (pathname == NULL) {
+		return -1;
+	}
+
+	dirCacheSlot *holder;
+	directoryEntry *entry = fs_resolve(pathname, &holder);
 	if (entry == NULL) {
-		return NULL;
+		return -1;
 	}
 	if (entry->type != DE_TYPE_DIRECTORY) {
-		return NULL;
+		fs_dcache_put(holder);
+		return -1;
 	}
-	return fs_load_dirdata(entry->location * fsVCB.numLBAPerBlock);
+
+	char newCWD[CWDMAX_LEN];
+	if (fs_path_join(newCWD, pathname) != 0) {
+		fprintf(stderr, "ERROR(%s): path is too long\n", __func__);
+		fs_dcache_put(holder);
+		return -1;
+	}
+	strcpy(fsCurrWorkDir, newCWD);
+
+	// pin new working directory
+	dirCacheSlot *cwd = fs_dcache_get(entry->location * fsVCB.numLBAPerBlock);
+	fs_dcache_put(holder);
+	if (fsCwdSlot != NULL) {
+		fs_dcache_put(fsCwdSlot);
+	}
+	fsCwdSlot = cwd;
+	return 0;
 }
 
-fdDir * _fs_opendir(const char *pathname)
+int fs_isFile(char * filename)
 {
-	// printf("DBG(%s): pathname=%s\n", __func__, pathname);
-
-	// remove trailing '/'
-	char *dir_path = strdup(pathname);
-	if (dir_path[strlen(dir_path) - 1] == '/') {
-		dir_path[strlen(dir_path) - 1] = 0;
+	FS_DIR_LOCK();
+	// printf("DBG(%s): path=%s\n", __func__, filename);
+	if (filename == NULL) {
+		return 0;
 	}
-	if (dir_path[0] == 0) {
-		dir_path[0] = '/';
-		dir_path[1] = 0;
+	if (strlen(filename) == 0) {
+		return 0;
 	}
-	// printf("dir_path=%s\n", dir_path);
 
-	// root directory
-	if (strcmp(dir_path, "/") == 0) {
-		// root directory
-		free(dir_path);
-		return fs_load_dirdata(fsVCB.rootDirStart * fsVCB.numLBAPerBlock);
+	dirCacheSlot *holder;
+	directoryEntry *entry = fs_resolve(filename, &holder);
+	if (entry == NULL) {
+		return 0;
 	}
+	int ret = (entry->type == DE_TYPE_FILE);
+	fs_dcache_put(holder);
+	return ret;
+}
 
-	fdDir *dirData = NULL;
-	if (dir_path[0] == '/') {
-		// absolute path
-		dirData = _fs_opendir("/");
-	}
-	else {
-		// relative path
-		dirData = _fs_opendir(fsCurrWorkDir);
-	}
-
-	char *saveptr;
-	char *s = strtok_r(dir_path, "/", &saveptr);
-	// printf("s=%s\n", s);
-	while (s != NULL) {
-		fdDir *newDirData = fs_opendirat(dirData, s);
-		_fs_closedir(dirData);
-		if (newDirData == NULL) {
-			free(dir_path);
-			return NULL;
-		}
-		dirData = newDirData;
-		s = strtok_r(NULL, "/", &saveptr);
+int fs_isDir(char *pathname)
+{
+	FS_DIR_LOCK();
+	// printf("DBG(%s): path=%s\n", __func__, pathname);
+	dirCacheSlot *holder;
+	directoryEntry *entry = fs_resolve(pathname, &holder);
+	if (entry == NULL) {
+		return 0;
 	}
-	free(dir_path);
-	return dirData;
+	int ret = (entry->type == DE_TYPE_DIRECTORY);
+	fs_dcache_put(holder);
+	return ret;
 }
 
-fdDir * fs_opendir(const char *pathname)
+int fs_delete(char *filename)
 {
-	fdDir *dirData = _fs_opendir(pathname);
-	fsFdDirOpened = dirData;
-	return dirData;
+	FS_DIR_LOCK();
+	//removes a file
+	return fs_remove_path(filename, DE_TYPE_FILE);
 }
 
-struct fs_diriteminfo *fs_readdir(fdDir *dirp)
+struct fs_diriteminfo *fs_create(fdDir *dirp, char * filename)
 {
-	struct fs_diriteminfo *item = &dirp->itemInfo;
-    memset(item, 0, sizeof(struct fs_diriteminfo));
+	FS_DIR_LOCK();
+	size_t len = strlen(filename);
+	if (len == 0 || len > DE_NAME_MAXLEN) {
+		fprintf(stderr, "ERROR(%s): bad name \"%s\"\n", __func__, filename);
+		return NULL;
+	}
 
-	directoryEntry *entries = dirp->entries;
-	for (int i = dirp->dirEntryPosition; i < DIRMAX_ENTRIES; i++) {
-		// continue if unused
-		if (entries[i].type == DE_TYPE_UNUSED) {
-			// next position for next fs_readdir
-			dirp->dirEntryPosition++;
-			continue;
-		}
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entries = dir->entries;
 
-		// copy information
-		strncpy(item->d_name, entries[i].name, DE_NAME_MAXLEN);
-		switch (entries[i].type) {
-			case DE_TYPE_DIRECTORY:
-				item->fileType = FT_DIRECTORY;
-				break;
-			case DE_TYPE_FILE:
-				item->fileType = FT_REGFILE;
-				break;
-			default:
-				fprintf(stderr, "ERROR(%s): unknown file type %d\n", __func__, entries[i].type);
-				break;
-		}
-		item->startLocationLBA = entries[i].location * fsVCB.numLBAPerBlock;
-		item->size = entries[i].size;
+	// find duplicate name in directory
+	if (fs_dcache_find(dir, filename, len) != NULL) {
+		fprintf(stderr, "ERROR(%s): %s already exists\n", __func__, filename);
+		fs_dcache_put(dir);
+		return NULL;
+	}
 
-		// next position for next fs_readdir
-		dirp->dirEntryPosition++;
-		return item;
+	// find unused entry with room for its record
+	int i = fs_dir_alloc_entry(dir, strlen(filename), 0);
+	if (i < 0) {
+		fprintf(stderr, "ERROR(%s): directory is full\n", __func__);
+		fs_dcache_put(dir);
+		return NULL;
 	}
+	directoryEntry * newEntry = &entries[i];
 
-	return NULL;
-}
+	// fill entry
+	memset(newEntry->name, 0, sizeof(newEntry->name));
+	strcpy(newEntry->name, filename);
+	newEntry->type = DE_TYPE_FILE;
+	newEntry->location = 0;		// empty inline file
+	newEntry->size = 0;
+	newEntry->dateCreated = time(NULL);
+	newEntry->lastModified = newEntry->dateCreated;
+	newEntry->lastOpened = newEntry->dateCreated;
+	fs_dir_add_name(dir, newEntry->name);
+	fs_dcache_dirty(dir, newEntry);
 
-int _fs_closedir(fdDir *dirp)
-{
-	// free all the stuff from open
-	free(dirp->entries);
-	free(dirp);
-	return(0);
-}
+	// write directory
+	fs_dcache_store(dir);
 
-int fs_closedir(fdDir *dirp)
-{
-	fsFdDirOpened = NULL;
-	return _fs_closedir(dirp);
-}
+	// file diriteminfo
+	struct fs_diriteminfo * di = &(dirp->itemInfo);
+	fs_fill_iteminfo(di, newEntry);
 
-// Misc directory functions
+	fs_dcache_put(dir);
+	return di;
+}
 
-char * fs_getcwd(char *pathname, size_t size)
+// inline data record of a file entry, NULL if it has none
+inlineDataEntry *fs_inline_record(dirCacheSlot *dir, directoryEntry *entry)
 {
-	if ((strlen(fsCurrWorkDir) + 1) >= size) {
+	int i = entry - dir->entries;
+	if (entry->type != DE_TYPE_FILE || entry->location != 0
+		|| i + 1 >= DIRMAX_ENTRIES || dir->entries[i + 1].type != DE_TYPE_INLINE) {
 		return NULL;
 	}
-	strcpy(pathname, fsCurrWorkDir);
-	return pathname;
+	return (inlineDataEntry *) &dir->entries[i + 1];
 }
 
-int fs_setcwd(char *pathname)
+int fs_get_inline(fdDir * dirp, char * filename, char * buffer)
 {
-	int ret;
-
-	// printf("%s: pathname=%s\n", __func__, pathname);
-	if (pathname == NULL) {
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
+	if (entry == NULL || entry->type != DE_TYPE_FILE || entry->location != 0) {
+		fs_dcache_put(dir);
 		return -1;
 	}
 
-	// set to root directory
-	if (strcmp(pathname, "/") == 0) {
-		strncpy(fsCurrWorkDir, "/", CWDMAX_LEN - 1);
-		return 0;
+	int size = 0;
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (record != NULL) {
+		size = record->length;
+		memcpy(buffer, record->data, size);
+	}
+
+	fs_dcache_put(dir);
+	return size;
+}
+
+int fs_set_inline(fdDir * dirp, char * filename, char * buffer, int size)
+{
+	FS_DIR_LOCK();
+	if (size > FS_INLINE_MAX) {
+		return -1;
 	}
 
-	// remove trailing '/'
-	char *dir_path = strdup(pathname);
-	if (dir_path[strlen(dir_path) - 1] == '/') {
-		dir_path[strlen(dir_path) - 1] = 0;
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entries = dir->entries;
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
+	if (entry == NULL || entry->type != DE_TYPE_FILE || entry->location != 0) {
+		fs_dcache_put(dir);
+		return -1;
 	}
 
-	// do nothing since '.' means current directory
-	if (strcmp(dir_path, ".") == 0) {
-		free(dir_path);
-		return 0;
+	// record must fit its block with the data
+	int i = entry - entries;
+	if (!fs_dir_room(dir, i, DE_RECORD_SIZE(strlen(entry->name), size))) {
+		fs_dcache_put(dir);
+		return -1;
 	}
 
-	// change to parent directory of current directory
-	if (strcmp(dir_path, "..") == 0) {
-		if (strcmp(fsCurrWorkDir, "/") == 0) {
-			// parent of root is still root
-			free(dir_path);
-			return 0;
-		}
-		else {
-			char *p = strrchr(fsCurrWorkDir, '/');
-			if (p != fsCurrWorkDir) {
-				p[0] = 0;
-			} else {
-				p[1] = 0;
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (size > 0 && record == NULL) {
+		if (i + 1 >= DIRMAX_ENTRIES || entries[i + 1].type != DE_TYPE_UNUSED) {
+			// move entry to a pair of unused entries
+			int j;
+			for (j = 2; j + 1 < DIRMAX_ENTRIES; j++) {
+				if (entries[j].type == DE_TYPE_UNUSED
+					&& entries[j + 1].type == DE_TYPE_UNUSED) {
+					break;
+				}
 			}
-			free(dir_path);
-			return 0;
+			if (j + 1 >= DIRMAX_ENTRIES) {
+				fs_dcache_put(dir);
+				return -1;
+			}
+			memcpy(&entries[j], entry, sizeof(directoryEntry));
+			memset(entry, 0, sizeof(directoryEntry));
+			fs_dcache_dirty(dir, entry);
+			entry = &entries[j];
+			i = j;
 		}
+		record = (inlineDataEntry *) &entries[i + 1];
+		record->type = DE_TYPE_INLINE;
 	}
 
-	char *savedCWD = strdup(fsCurrWorkDir);
-
-	// 1-level related to current directory
-	if (strchr(dir_path, '/') == NULL) {
-		if ((strlen(fsCurrWorkDir) + strlen(dir_path) + 2) > CWDMAX_LEN) {
-			fprintf(stderr, "ERROR(%s): path is too long\n", __func__);
-		}
-		if (strcmp(fsCurrWorkDir, "/") != 0) {
-			strcat(fsCurrWorkDir, "/");
+	if (record != NULL) {
+		if (size == 0) {
+			memset(record, 0, sizeof(directoryEntry));
 		}
-		strcat(fsCurrWorkDir, dir_path);
-		fdDir *dirData = _fs_opendir(fsCurrWorkDir);
-		if (dirData == NULL) {
-			strcpy(fsCurrWorkDir, savedCWD);
-			free(savedCWD);
-			free(dir_path);
-			return -1;
-		} 
 		else {
-			fs_closedir(dirData);
-			free(savedCWD);
-			free(dir_path);
-			return 0;
+			memset(record->data, 0, sizeof(record->data));
+			memcpy(record->data, buffer, size);
+			record->length = size;
 		}
+		fs_dcache_dirty(dir, (directoryEntry *) record);
 	}
 
-	// multi-level related to current directory
-	if (dir_path[0] == '/') {
-		fs_setcwd("/");
-	}
-	char *saveptr;
-	char *s = strtok_r(dir_path, "/", &saveptr);
-	while (s != NULL) {
-		// printf("DBG(%s) s=%s\n", __func__, s);
-		ret = fs_setcwd(s);
-		if (ret != 0) {
-			strcpy(fsCurrWorkDir, savedCWD);
-			break;
-		}
-		s = strtok_r(NULL, "/", &saveptr);
-	}
-	free(savedCWD);
-	free(dir_path);
-	return ret;
+	entry->size = size;
+	entry->lastModified = time(NULL);
+	fs_dcache_dirty(dir, entry);
+
+	// write directory
+	fs_dcache_store(dir);
+	fs_dcache_put(dir);
+	return 0;
 }
 
-int fs_isFile(char * filename)
+int fs_set_fileLocation(fdDir * dirp, char * filename, uint64_t location)
 {
-	// printf("DBG(%s): path=%s\n", __func__, filename);
-	if (filename == NULL) {
-		return 0;
-	}
-	if (strlen(filename) == 0) {
-		return 0;
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
+	if (entry == NULL) {
+		fs_dcache_put(dir);
+		return -1;
 	}
 
-	pathnameInfo info = fs_parse_pathname(filename);
-	if (info.name == NULL) {
-		fs_free_pathname_info(&info);
-		return 0;
+	// data leaves the directory
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (record != NULL) {
+		memset(record, 0, sizeof(directoryEntry));
+		fs_dcache_dirty(dir, (directoryEntry *) record);
 	}
 
-	fdDir *dirData;
-	if (info.path == NULL) {
-		dirData = _fs_opendir(fsCurrWorkDir);
-	}
-	else {
-		dirData = _fs_opendir(info.path);
+	entry->location = location;
+	fs_dcache_dirty(dir, entry);
+
+	// write directory
+	fs_dcache_store(dir);
+	fs_dcache_put(dir);
+	return 0;
+}
+
+int fs_set_fileMap(fdDir * dirp, char * filename, uint32_t mapBlocks, uint32_t allocBlocks)
+{
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
+	if (entry == NULL || entry->type != DE_TYPE_FILE || entry->location == 0) {
+		fs_dcache_put(dir);
+		return -1;
 	}
-	if (dirData == NULL) {
-		fs_free_pathname_info(&info);
+	if (entry->mapBlocks == mapBlocks && entry->allocBlocks == allocBlocks) {
+		fs_dcache_put(dir);
 		return 0;
 	}
 
-	directoryEntry *entry = fs_find_entry_atdir(dirData, info.name);
-	if (entry == NULL) {
-		fs_closedir(dirData);
-		fs_free_pathname_info(&info);
-		return 0;
+	// record must fit its block with the block counts
+	int i = entry - dir->entries;
+	int dataLen = (allocBlocks > 0) ? sizeof(sparseRecord) : 0;
+	if (!fs_dir_room(dir, i, DE_RECORD_SIZE(strlen(entry->name), dataLen))) {
+		fs_dcache_put(dir);
+		return -1;
 	}
-	fs_free_pathname_info(&info);
 
-	int ret;
-	if (entry->type == DE_TYPE_FILE) {
-		ret = 1;
-	}
-	else {
-		ret = 0;
-	}
+	entry->mapBlocks = mapBlocks;
+	entry->allocBlocks = allocBlocks;
+	fs_dcache_dirty(dir, entry);
 
-	fs_closedir(dirData);
-	return ret;
+	// write directory
+	fs_dcache_store(dir);
+	fs_dcache_put(dir);
+	return 0;
 }
 
-int fs_isDir(char *pathname)
+int fs_truncate_file(fdDir * dirp, char * filename)
 {
-	// printf("DBG(%s): path=%s\n", __func__, pathname);
-	if (strcmp(pathname, ".") == 0) {
-		return 1;
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
+	if (entry == NULL || entry->type != DE_TYPE_FILE) {
+		fs_dcache_put(dir);
+		return -1;
 	}
-	if (strcmp(pathname, "..") == 0) {
-		return 1;
+
+	inlineDataEntry *record = fs_inline_record(dir, entry);
+	if (record != NULL) {
+		memset(record, 0, sizeof(directoryEntry));
+		fs_dcache_dirty(dir, (directoryEntry *) record);
 	}
 
-	fdDir *dirData = _fs_opendir(pathname);
-	if (dirData == NULL) {
-		return 0;
+	uint64_t location = entry->location;
+	entry->location = 0;
+	entry->size = 0;
+	entry->mapBlocks = 0;
+	entry->allocBlocks = 0;
+	entry->lastModified = time(NULL);
+	fs_dcache_dirty(dir, entry);
+
+	// write directory, then the whole chain goes to the reclaimer at once
+	if (location != 0) {
+		fs_dcache_commit(dir);
+		deferFreeBlocks(location);
 	}
 	else {
-		_fs_closedir(dirData);
-		return 1;
+		fs_dcache_store(dir);
 	}
+	fs_dcache_put(dir);
+	return 0;
 }
 
-int fs_delete(char *filename)
+int fs_set_fileSize(fdDir * dirp, char * filename, int size)
 {
-	//removes a file
-    //free the block
-    //write it back to disk
-
-	// fprintf(stderr, "ERROR(%s): unsupported\n", __func__);
-	// return -1;
-	fdDir *dir = _fs_opendir(".");
-	if (dir == NULL) {
-		return -1;
-	}
-
-	directoryEntry *entry = fs_find_entry_atdir(dir, filename);
+	FS_DIR_LOCK();
+	dirCacheSlot *dir = fs_dcache_get(dirp->directoryStartLocation);
+	directoryEntry *entry = fs_dcache_find(dir, filename, strlen(filename));
 	if (entry == NULL) {
-		fs_closedir(dir);
+		fs_dcache_put(dir);
 		return -1;
 	}
 
-	entry->type = DE_TYPE_UNUSED;
-	freeAllocatedBlocks(entry->location);
+	if (entry->size != size) {
+		entry->size = size;
+		fs_dcache_dirty(dir, entry);
 
-	// store directory data
-	fs_store_dirdata(dir);
-
-	fs_closedir(dir);
+		// write directory
+		fs_dcache_store(dir);
+	}
+	fs_dcache_put(dir);
 	return 0;
 }
 
-struct fs_diriteminfo *fs_create(fdDir *dir, char * filename)
+// rebuild the path of the working directory by walking up from it, after
+// a directory above it was moved
+void fs_cwd_rebuild(void)
 {
-	directoryEntry *entries = dir->entries;
-
-	// find duplicate name in directory
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		if (strcmp(entries[i].name, filename) == 0
-			&& entries[i].type != DE_TYPE_UNUSED) {
-			fprintf(stderr, "ERROR(%s): %s already exists\n", __func__, filename);
-			return NULL;
+	char path[CWDMAX_LEN];
+	size_t pos = CWDMAX_LEN - 1;
+	path[pos] = 0;
+
+	uint64_t block = fsCwdSlot->entries[0].location;
+	uint64_t parentBlock = fsCwdSlot->entries[1].location;
+	while (block != fsVCB.rootDirStart) {
+		// find name of block in its parent
+		dirCacheSlot *parent = fs_dcache_get(parentBlock * fsVCB.numLBAPerBlock);
+		const char *name = NULL;
+		for (int i = 2; i < DIRMAX_ENTRIES; i++) {
+			if (parent->entries[i].type == DE_TYPE_DIRECTORY
+				&& parent->entries[i].location == block) {
+				name = parent->entries[i].name;
+				break;
+			}
+		}
+		size_t len = (name != NULL) ? strlen(name) : 0;
+		if (name == NULL || len + 1 > pos) {
+			fs_dcache_put(parent);
+			return;
 		}
+		pos -= len;
+		memcpy(path + pos, name, len);
+		path[--pos] = '/';
+
+		block = parentBlock;
+		parentBlock = parent->entries[1].location;
+		fs_dcache_put(parent);
+	}
+	if (path[pos] == 0) {
+		path[--pos] = '/';
 	}
+	strcpy(fsCurrWorkDir, path + pos);
+}
 
-	// find unused entries in directory
-	directoryEntry * newEntry = NULL;
-	for (int i = 0; i < DIRMAX_ENTRIES; i++) {
-		if (entries[i].type == DE_TYPE_UNUSED) {
-			newEntry = &entries[i];
-			break;
-		}
+// move entry (with its inline data) of srcDir to destDir under name
+int fs_dir_move_entry(dirCacheSlot *srcDir, directoryEntry *srcEntry,
+					  dirCacheSlot *destDir, const char *name)
+{
+	inlineDataEntry *data = fs_inline_record(srcDir, srcEntry);
+	int dataLen = (data != NULL) ? data->length : 0;
+	int i = fs_dir_alloc_entry(destDir, strlen(name), dataLen);
+	if (i >= 0 && srcEntry->type == DE_TYPE_FILE && srcEntry->allocBlocks > 0
+		&& !fs_dir_room(destDir, i, DE_RECORD_SIZE(strlen(name), sizeof(sparseRecord)))) {
+		// no room for the block counts of a sparse file
+		i = -1;
 	}
-	if (newEntry == NULL) {
-		return NULL;
+	if (i < 0) {
+		fprintf(stderr, "%s: directory is full\n", __func__);
+		return -1;
 	}
 
-	// fill entry
+	// new link first, so the entry stays reachable if the old one is
+	// never removed
+	directoryEntry *newEntry = &destDir->entries[i];
+	memcpy(newEntry, srcEntry, sizeof(directoryEntry));
 	memset(newEntry->name, 0, sizeof(newEntry->name));
-	strncpy(newEntry->name, filename, sizeof(newEntry->name));
-	newEntry->type = DE_TYPE_FILE;
-	newEntry->location = allocateFreeBlocks(1);
-	newEntry->size = 0;
-	newEntry->dateCreated = time(NULL);
-	newEntry->lastModified = newEntry->dateCreated;
-	newEntry->lastOpened = newEntry->dateCreated;
-
-	// write directory
-	fs_store_dirdata(dir);
-
-	// file diriteminfo
-	struct fs_diriteminfo * di = &(dir->itemInfo);
-	memset(di, 0, sizeof(struct fs_diriteminfo));
-	strncpy(di->d_name, newEntry->name, sizeof(di->d_name));
-	di->d_name[sizeof(newEntry->name)] = 0;
-	di->fileType = FT_REGFILE;
-	di->startLocationLBA = newEntry->location * fsVCB.numLBAPerBlock;
-	di->size = newEntry->size;
-
-	return di;
+	strcpy(newEntry->name, name);
+	if (data != NULL) {
+		memcpy(&destDir->entries[i + 1], data, sizeof(directoryEntry));
+		fs_dcache_dirty(destDir, &destDir->entries[i + 1]);
+	}
+	fs_dir_add_name(destDir, newEntry->name);
+	fs_dcache_dirty(destDir, newEntry);
+	fs_dcache_store(destDir);
+
+	// then drop the old link
+	if (data != NULL) {
+		memset(data, 0, sizeof(directoryEntry));
+		fs_dcache_dirty(srcDir, (directoryEntry *) data);
+	}
+	memset(srcEntry, 0, sizeof(directoryEntry));
+	fs_dcache_dirty(srcDir, srcEntry);
+	fs_dcache_store(srcDir);
+
+	// a moved directory has a new parent
+	if (newEntry->type == DE_TYPE_DIRECTORY) {
+		dirCacheSlot *moved = fs_dcache_get(newEntry->location * fsVCB.numLBAPerBlock);
+		moved->entries[1].location = destDir->entries[0].location;
+		fs_dcache_dirty(moved, &moved->entries[1]);
+		fs_dcache_store(moved);
+		fs_dcache_put(moved);
+
+		// working directory may have moved along
+		if (fs_dir_is_ancestor(fsCwdSlot, newEntry->location)) {
+			fs_cwd_rebuild();
+		}
+	}
+	return 0;
 }
 
-int fs_set_fileSize(fdDir * dir, char * filename, int size)
+// rename entry srcName of srcDir to destName in destDir (first srcLen
+// and destLen characters). Only entries are relinked, file data is not
+// touched.
+int fs_dir_rename(dirCacheSlot *srcDir, const char *srcName, size_t srcLen,
+				  dirCacheSlot *destDir, const char *destName, size_t destLen)
 {
-	directoryEntry *entry = fs_find_entry_atdir(dir, filename);
-	if (entry == NULL) {
+	// find entry of source
+	directoryEntry *srcEntry = NULL;
+	if (srcLen > 0 && !(srcLen == 1 && srcName[0] == '.')
+		&& !(srcLen == 2 && srcName[0] == '.' && srcName[1] == '.')) {
+		srcEntry = fs_dcache_find(srcDir, srcName, srcLen);
+	}
+	if (srcEntry == NULL) {
+		fprintf(stderr, "fs_rename: src '%.*s' does not exist\n", (int) srcLen, srcName);
 		return -1;
 	}
 
-	entry->size = size;
+	char name[DE_NAME_MAXLEN + 1];
+	if (destLen == 0 || destLen > DE_NAME_MAXLEN) {
+		fprintf(stderr, "fs_rename: bad dest name '%.*s'\n", (int) destLen, destName);
+		return -1;
+	}
+	memcpy(name, destName, destLen);
+	name[destLen] = 0;
 
-	// write directory
-	fs_store_dirdata(dir);
+	if (fs_dcache_find(destDir, destName, destLen) != NULL) {
+		fprintf(stderr, "fs_rename: dest '%s' already exists\n", name);
+		return -1;
+	}
+	if (srcEntry->type == DE_TYPE_DIRECTORY
+		&& fs_dir_is_ancestor(destDir, srcEntry->location)) {
+		fprintf(stderr, "fs_rename: cannot move '%.*s' into itself\n", (int) srcLen, srcName);
+		return -1;
+	}
+	if (destDir->location != srcDir->location) {
+		return fs_dir_move_entry(srcDir, srcEntry, destDir, name);
+	}
+
+	// rename in place, record must fit its block with the new name
+	int i = srcEntry - srcDir->entries;
+	int newLen = fs_entry_record_size(srcDir, i) - strlen(srcEntry->name) + destLen;
+	if (!fs_dir_room(srcDir, i, newLen)) {
+		fprintf(stderr, "fs_rename: directory is full\n");
+		return -1;
+	}
+	memset(srcEntry->name, 0, sizeof(srcEntry->name));
+	strcpy(srcEntry->name, name);
+	fs_dir_add_name(srcDir, srcEntry->name);
+	fs_dcache_dirty(srcDir, srcEntry);
+	fs_dcache_store(srcDir);
+
+	// path of working directory may contain the old name
+	if (srcEntry->type == DE_TYPE_DIRECTORY
+		&& fs_dir_is_ancestor(fsCwdSlot, srcEntry->location)) {
+		fs_cwd_rebuild();
+	}
+	return 0;
 }
 
+// Renames or moves src to dest. If dest is an existing directory src is
+// moved into it.
 int fs_rename(char * src, char * dest)
 {
+	FS_DIR_LOCK();
 	// sanity check
 	if (strcmp(src, dest) == 0) {
 		fprintf(stderr, "%s: '%s' and '%s' are the same file\n", __func__, src, dest);
 		return -1;
 	}
 
-	// open current directory
-	fdDir *dir = _fs_opendir(".");
-	if (dir == NULL) {
-		return -1;
-	}
-
-	// find entry of source
-	directoryEntry *srcEntry = fs_find_entry_atdir(dir, src);
-	if (srcEntry == NULL) {
+	const char *srcName;
+	size_t srcLen;
+	dirCacheSlot *srcDir = fs_resolve_parent(src, &srcName, &srcLen);
+	if (srcDir == NULL) {
 		fprintf(stderr, "%s: src '%s' does not exist\n", __func__, src);
-		_fs_closedir(dir);
 		return -1;
 	}
 
-	// check entry of destination
-	directoryEntry *destEntry = fs_find_entry_atdir(dir, dest);
-	if (destEntry != NULL) {
-		fprintf(stderr, "%s: dest '%s' already exists\n", __func__, src);
-		_fs_closedir(dir);
-		return -1;
+	// find directory of destination, an existing directory receives the
+	// entry under its own name
+	const char *destName;
+	size_t destLen;
+	dirCacheSlot *destDir;
+	dirCacheSlot *holder;
+	directoryEntry *destEntry = fs_resolve(dest, &holder);
+	if (destEntry != NULL && destEntry->type == DE_TYPE_DIRECTORY) {
+		destDir = fs_dcache_get(destEntry->location * fsVCB.numLBAPerBlock);
+		fs_dcache_put(holder);
+		destName = srcName;
+		destLen = srcLen;
+	}
+	else {
+		if (destEntry != NULL) {
+			fprintf(stderr, "%s: dest '%s' already exists\n", __func__, dest);
+			fs_dcache_put(holder);
+			fs_dcache_put(srcDir);
+			return -1;
+		}
+		destDir = fs_resolve_parent(dest, &destName, &destLen);
+		if (destDir == NULL) {
+			fprintf(stderr, "%s: directory of dest '%s' does not exist\n", __func__, dest);
+			fs_dcache_put(srcDir);
+			return -1;
+		}
 	}
 
-	// change name of source entry
-	strncpy(srcEntry->name, dest, sizeof(srcEntry->name));
-
-	// write directory
-	fs_store_dirdata(dir);
+	int ret = fs_dir_rename(srcDir, srcName, srcLen, destDir, destName, destLen);
+	fs_dcache_put(destDir);
+	fs_dcache_put(srcDir);
+	return ret;
+}
 
-	_fs_closedir(dir);
+int fs_renameat(fdDir *srcDirp, const char *src, fdDir *destDirp, const char *dest)
+{
+	FS_DIR_LOCK();
+	if (strchr(src, '/') != NULL || strchr(dest, '/') != NULL) {
+		return -1;
+	}
+	dirCacheSlot *srcDir = fs_dcache_get(srcDirp->directoryStartLocation);
+	dirCacheSlot *destDir = fs_dcache_get(destDirp->directoryStartLocation);
+	int ret = fs_dir_rename(srcDir, src, strlen(src), destDir, dest, strlen(dest));
+	fs_dcache_put(destDir);
+	fs_dcache_put(srcDir);
+	return ret;
 }
 
 int fs_stat(const char *path, struct fs_stat *buf)
 {
+	FS_DIR_LOCK();
 	// printf("%s: path=%s\n", __func__, path);
-	char *new_path = strdup(path);
-
 	if (fsFdDirOpened != NULL) {
 		// fdDir recently opened
-		directoryEntry *entry = fs_find_entry_atdir(fsFdDirOpened, path);
+		dirCacheSlot *dir = fs_dcache_get(fsFdDirOpened->directoryStartLocation);
+		directoryEntry *entry = fs_dcache_find(dir, path, strlen(path));
 		if (entry == NULL) {
 			// not found
 			fprintf(stderr, "ERROR(%s): cannot find \"%s\"\n", __func__, path);
+			fs_dcache_put(dir);
 			return -1;
 		}
-		if (entry->type == DE_TYPE_FILE) {
-			// fill status of file
-			buf->st_size = entry->size;
-			buf->st_blksize = fsVCB.blockSize;
-			buf->st_blocks = (entry->size + 512 - 1)/512;
-			buf->st_accesstime = entry->lastOpened;
-			buf->st_modtime = entry->lastModified;
-			buf->st_createtime = entry->dateCreated;
-			free(new_path);
-			return 0;
-		}
-		else if (entry->type == DE_TYPE_DIRECTORY) {
-			// fill status of directory
-			buf->st_size = entry->size;
-			buf->st_blksize = fsVCB.blockSize;
-			buf->st_blocks = (entry->size + 512 - 1)/512;
-			buf->st_accesstime = entry->lastOpened;
-			buf->st_modtime = entry->lastModified;
-			buf->st_createtime = entry->dateCreated;
-			free(new_path);
-			return 0;
-		}
-		else {
-			fprintf(stderr, "ERROR(%s): unknown type\n", __func__);
-			free(new_path);
-			return -1;
-		}
-	}
-
-	if (fs_isFile(new_path)) {
-		// try to open directory
-		fdDir *dirData = _fs_opendir(path);
-		if (dirData == NULL) {
-			free(new_path);
-			return -1;
-		}
-
-		// fill status from opened directory
-		directoryEntry *entries = dirData->entries;
-		buf->st_size = entries[0].size;
-		buf->st_blksize = fsVCB.blockSize;
-		buf->st_blocks = (entries[0].size + 512 - 1)/512;
-		buf->st_accesstime = entries[0].lastOpened;
-		buf->st_modtime = entries[0].lastModified;
-		buf->st_createtime = entries[0].dateCreated;
-
-		fs_closedir(dirData);
-		free(new_path);
+		// fill status of file or directory
+		fs_fill_stat(buf, entry);
+		fs_dcache_put(dir);
 		return 0;
 	}
-	if (fs_isDir(new_path)) {
-		// try to open directory
-		fdDir *dirData = _fs_opendir(path);
-		if (dirData == NULL) {
-			free(new_path);
-			return -1;
-		}
 
-		// fill status from opened directory
-		directoryEntry *entries = dirData->entries;
-		buf->st_size = entries[0].size;
-		buf->st_blksize = fsVCB.blockSize;
-		buf->st_blocks = (entries[0].size + 512 - 1)/512;
-		buf->st_accesstime = entries[0].lastOpened;
-		buf->st_modtime = entries[0].lastModified;
-		buf->st_createtime = entries[0].dateCreated;
+	// status of file or directory ("." of a directory)
+	struct fs_lookup_result result;
+	if (fs_lookup(path, &result) != 0) {
+		return -1;
+	}
+	memcpy(buf, &result.st, sizeof(struct fs_stat));
+	return 0;
+}
 
-		fs_closedir(dirData);
-		free(new_path);
+int fs_file_extents(const char *path)
+{
+	FS_DIR_LOCK();
+	struct fs_lookup_result result;
+	if (fs_lookup(path, &result) != 0 || result.item.fileType != FT_REGFILE) {
+		return -1;
+	}
+	if (result.item.startLocationLBA == 0) {
 		return 0;
 	}
 
-	free(new_path);
-	return -1;
+	fat_file_blockinfo *bi;
+	int location = fs_lba_block(result.item.startLocationLBA);
+	if (result.item.mapBlocks > 0) {
+		bi = fat_get_file_map(location, result.item.mapBlocks, result.item.size);
+	}
+	else {
+		bi = fat_get_file_blockinfo(location);
+	}
+	if (bi == NULL) {
+		return -1;
+	}
+	int extents = 0;
+	for (int i = 0; i < bi->total_blocks; i++) {
+		int block = bi->table_blocknumbers[i];
+		if (block != 0 && (i == 0 || block != bi->table_blocknumbers[i - 1] + 1)) {
+			extents++;
+		}
+	}
+	fat_free_file_blockinfo(bi);
+	return extents;
 }
@@ -19,11 +19,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <getopt.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "fsLow.h"
 #include "mfs.h"
@@ -34,6 +37,7 @@
 #define DOUBLE_QUOTE	0x22
 #define BUFFERLEN		200
 #define DIRMAX_LEN		4096
+#define LSBATCH			16
 
 /****   SET THESE TO 1 WHEN READY TO TEST THAT COMMAND ****/
 #define CMDLS_ON	1
@@ -68,21 +72,32 @@ int cmd_cp2l (int argcnt, char *argvec[]);
 int cmd_cp2fs (int argcnt, char *argvec[]);
 int cmd_cd (int argcnt, char *argvec[]);
 int cmd_pwd (int argcnt, char *argvec[]);
+int cmd_stats (int argcnt, char *argvec[]);
+int cmd_bench (int argcnt, char *argvec[]);
+int cmd_discard (int argcnt, char *argvec[]);
+int cmd_defrag (int argcnt, char *argvec[]);
+int cmd_df (int argcnt, char *argvec[]);
 int cmd_history (int argcnt, char *argvec[]);
 int cmd_help (int argcnt, char *argvec[]);
+double benchSeconds (struct timespec * start);
 
 dispatch_t dispatchTable[] = {
 	{"ls", cmd_ls, "Lists the file in a directory"},
 	{"cp", cmd_cp, "Copies a file - source [dest]"},
 	{"mv", cmd_mv, "Moves a file - source dest"},
 	{"md", cmd_md, "Make a new directory"},
-	{"rm", cmd_rm, "Removes a file or directory"},
+	{"rm", cmd_rm, "Removes a file or directory - [-r] removes a whole tree"},
         {"touch",cmd_touch, "Touches/Creates a file"},
         {"cat", cmd_cat, "Limited version of cat that displace the file to the console"},
 	{"cp2l", cmd_cp2l, "Copies a file from the test file system to the linux file system"},
 	{"cp2fs", cmd_cp2fs, "Copies a file from the Linux file system to the test file system"},
 	{"cd", cmd_cd, "Changes directory"},
 	{"pwd", cmd_pwd, "Prints the working directory"},
+	{"stats", cmd_stats, "Prints file system counters - [-r] resets them"},
+	{"bench", cmd_bench, "Runs a microbenchmark - lookup, ls, scan, frag, tree, scale"},
+	{"discard", cmd_discard, "Punches freed blocks out of the volume file - [on|off]"},
+	{"defrag", cmd_defrag, "Rewrites fragmented files contiguously - [-r KiB/s] [path]"},
+	{"df", cmd_df, "Reports free space and fragmentation - [-f] lists files, [-c] compacts first"},
 	{"history", cmd_history, "Prints out the history"},
 	{"help", cmd_help, "Prints out help"}
 };
@@ -97,24 +112,37 @@ int displayFiles (fdDir * dirp, int flall, int fllong)
 		return (-1);
 	
 	struct fs_diriteminfo * di;
-	struct fs_stat statbuf;
+	struct fs_direntplus batch[LSBATCH];
+	int n;
 	
-	di = fs_readdir (dirp);
 	printf("\n");
-	while (di != NULL) 
+	if (fllong)
 		{
-		if ((di->d_name[0] != '.') || (flall)) //if not all and starts with '.' it is hidden
+		// names and attributes come back together, a batch at a time
+		while ((n = fs_readdirplus (dirp, batch, LSBATCH)) > 0)
 			{
-			if (fllong)
+			for (int i = 0; i < n; i++)
 				{
-				fs_stat (di->d_name, &statbuf);
-				printf ("%s    %9ld   %s\n", fs_isDir(di->d_name)?"D":"-", statbuf.st_size, di->d_name);
-				}
-			else
-				{
-				printf ("%s\n", di->d_name);
+				di = &batch[i].item;
+				if ((di->d_name[0] != '.') || (flall)) //if not all and starts with '.' it is hidden
+					{
+					// size, then 512 byte blocks taken (fewer for sparse files)
+					printf ("%s    %9ld %7ld   %s\n", (di->fileType == FT_DIRECTORY)?"D":"-",
+						batch[i].st.st_size, (long)batch[i].st.st_blocks, di->d_name);
+					}
 				}
 			}
+		fs_closedir (dirp);
+		return 0;
+		}
+
+	di = fs_readdir (dirp);
+	while (di != NULL) 
+		{
+		if ((di->d_name[0] != '.') || (flall)) //if not all and starts with '.' it is hidden
+			{
+			printf ("%s\n", di->d_name);
+			}
 		di = fs_readdir (dirp);
 		}
 	fs_closedir (dirp);
@@ -199,22 +227,27 @@ int cmd_ls (int argcnt, char *argvec[])
 		//processing arguments after options
 		for (int k = optind; k < argcnt; k++)
 			{
-			if (fs_isDir(argvec[k]))
+			struct fs_lookup_result result;
+			if (fs_lookup (argvec[k], &result) != 0)
+				{
+				printf ("%s is not found\n", argvec[k]);
+				}
+			else if (result.item.fileType == FT_DIRECTORY)
 				{
 				fdDir * dirp;
-				dirp = fs_opendir (argvec[k]);
+				dirp = fs_opendir_lookup (&result);
 				displayFiles (dirp, flall, fllong);
 				}
-			else // it is just a file ?
+			else // it is just a file
 				{
-				if (fs_isFile (argvec[k]))
+				if (fllong)
 					{
-					//no support for long format here
-					printf ("%s\n", argvec[k]);
+					printf ("%s    %9ld %7ld   %s\n", "-",
+						result.st.st_size, (long)result.st.st_blocks, argvec[k]);
 					}
 				else
 					{
-					printf ("%s is not found\n", argvec[k]);
+					printf ("%s\n", argvec[k]);
 					}
 				}
 			}		
@@ -240,25 +273,34 @@ int cmd_touch (int argcnt, char *argvec[])
         {
 #if (CMDTOUCH_ON == 1)     
         int testfs_src_fd;
-        char * src;
 
-        switch (argcnt)
+        if (argcnt < 2)
                 {
-                case 2: //only one name provided
-                        src = argvec[1];
-                        break;
-
-                default:
-                        printf("Usage: touch srcfile\n");
-                        return (-1);
+                printf("Usage: touch srcfile [srcfile ...]\n");
+                return (-1);
                 }
 
+        // directory updates for all the files are written once, plain
+        // names are opened in the working directory without resolving
+        fdDir * cwdp = fs_opendir (".");
+        fs_batch_begin ();
+        for (int i = 1; i < argcnt; i++)
+                {
+                if (strchr (argvec[i], '/') == NULL)
+                        testfs_src_fd = b_openat (cwdp, argvec[i], O_WRONLY | O_CREAT);
+                else
+                        testfs_src_fd = b_open (argvec[i], O_WRONLY | O_CREAT);
+                if (testfs_src_fd < 0)
+                        {
+                        fs_batch_end ();
+                        fs_closedir (cwdp);
+                        return (testfs_src_fd);	//return with error
+                        }
 
-        testfs_src_fd = b_open (src, O_WRONLY | O_CREAT);
-        if (testfs_src_fd < 0)
-	    return (testfs_src_fd);	//return with error
-
-        b_close (testfs_src_fd);
+                b_close (testfs_src_fd);
+                }
+        fs_batch_end ();
+        fs_closedir (cwdp);
 #endif
         return 0;
         }
@@ -409,23 +451,39 @@ int cmd_md (int argcnt, char *argvec[])
 int cmd_rm (int argcnt, char *argvec[])
 	{
 #if (CMDRM_ON == 1)
+	if (argcnt == 3 && strcmp (argvec[1], "-r") == 0)
+		{
+		struct fs_rmtree_stats st;
+		struct timespec start;
+
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		if (fs_rmtree (argvec[2], &st) != 0)
+			return -1;
+		double secs = benchSeconds (&start);
+		printf ("removed %llu entries, freed %llu blocks in %.6f s"
+			" (%.0f entries/s, %.0f blocks/s)\n",
+			(ull_t)st.entries, (ull_t)st.blocks, secs,
+			st.entries / secs, st.blocks / secs);
+		return 0;
+		}
 	if (argcnt != 2)
 		{
-		printf ("Usage: rm path\n");
+		printf ("Usage: rm [-r] path\n");
 		return -1;
 		}
 		
 	char * path = argvec[1];	
 	
-	//must determine if file or directory
-	if (fs_isDir (path))
+	//must determine if file or directory, then remove it from the
+	//directory found on the way
+	struct fs_lookup_result result;
+	if (fs_lookup (path, &result) == 0)
 		{
-		return (fs_rmdir (path));
-		}		
-	if (fs_isFile (path))
-		{
-		return (fs_delete(path));
-		}	
+		fdDir * parent = fs_opendir_parent (&result);
+		int ret = fs_remove (parent, result.item.d_name);
+		fs_closedir (parent);
+		return (ret);
+		}
 		
 	printf("The path %s is neither a file not a directory\n", path);
 #endif
@@ -507,15 +565,44 @@ int cmd_cp2fs (int argcnt, char *argvec[])
 		}
 	
 	
-	testfs_fd = b_open (dest, O_WRONLY | O_CREAT | O_TRUNC);
 	linux_fd = open (src, O_RDONLY);
+	if (linux_fd < 0)
+		{
+		printf ("cp2fs: cannot open %s\n", src);
+		return (-1);
+		}
+	testfs_fd = b_open (dest, O_WRONLY | O_CREAT | O_TRUNC);
+	if (testfs_fd < 0)
+		{
+		printf ("cp2fs: cannot open %s\n", dest);
+		close (linux_fd);
+		return (-1);
+		}
+
+	// the size is known, so take all the blocks at once
+	struct stat st;
+	int ret = 0;
+	if (fstat (linux_fd, &st) == 0 && st.st_size > FS_INLINE_MAX
+		&& b_fallocate (testfs_fd, 0, st.st_size) < 0)
+		{
+		printf ("cp2fs: no room for %s\n", dest);
+		b_close (testfs_fd);
+		close (linux_fd);
+		return (-1);
+		}
 	do 
 		{
 		readcnt = read (linux_fd, buf, BUFFERLEN);
-		b_write (testfs_fd, buf, readcnt);
+		if (readcnt > 0 && b_write (testfs_fd, buf, readcnt) != readcnt)
+			{
+			printf ("cp2fs: no room for %s\n", dest);
+			ret = -1;
+			break;
+			}
 		} while (readcnt == BUFFERLEN);
 	b_close (testfs_fd);
 	close (linux_fd);
+	return (ret);
 #endif
 	return 0;
 	}
@@ -577,6 +664,595 @@ int cmd_pwd (int argcnt, char *argvec[])
 	return 0;
 	}
 
+/****************************************************
+*  Stats commmand
+****************************************************/
+int cmd_stats (int argcnt, char *argvec[])
+	{
+	struct fs_perfstats st;
+
+	if ((argcnt == 2) && (strcmp(argvec[1], "-r") == 0))
+		{
+		fs_reset_stats();
+		return 0;
+		}
+	if (argcnt != 1)
+		{
+		printf ("Usage: stats [-r]\n");
+		return -1;
+		}
+
+	fs_get_stats (&st);
+	uint64_t misses = st.bloomRejects + st.bloomFalsePositives;
+	printf ("lookups:               %llu\n", (ull_t)st.lookups);
+	printf ("  negative cache hits: %llu\n", (ull_t)st.negCacheHits);
+	printf ("  bloom rejects:       %llu\n", (ull_t)st.bloomRejects);
+	printf ("  bloom false pos.:    %llu (%.2f%% of misses)\n",
+		(ull_t)st.bloomFalsePositives,
+		misses ? 100.0 * st.bloomFalsePositives / misses : 0.0);
+	printf ("  entry scans:         %llu\n", (ull_t)st.entryScans);
+	printf ("directory loads:       %llu\n", (ull_t)st.dirLoads);
+	printf ("directory block reads: %llu\n", (ull_t)st.dirBlockReads);
+	printf ("directory block writes:%llu\n", (ull_t)st.dirBlockWrites);
+	printf ("heap allocations:      %llu\n", (ull_t)st.heapAllocs);
+	printf ("FAT block writes:      %llu\n", (ull_t)st.fatBlockWrites);
+	printf ("chains deferred:       %llu\n", (ull_t)st.chainsDeferred);
+	printf ("blocks reclaimed:      %llu\n", (ull_t)st.blocksReclaimed);
+	printf ("discard calls:         %llu\n", (ull_t)st.discardCalls);
+	printf ("blocks discarded:      %llu\n", (ull_t)st.blocksDiscarded);
+	printf ("data block I/O calls:  %llu\n", (ull_t)st.ioCalls);
+	printf ("  avg seek distance:   %.1f LBAs\n",
+		st.ioCalls ? (double)st.seekLBAs / st.ioCalls : 0.0);
+	printf ("allocation lock waits: %llu\n", (ull_t)st.allocLockWaits);
+	return 0;
+	}
+
+/****************************************************
+*  Discard commmand
+****************************************************/
+int cmd_discard (int argcnt, char *argvec[])
+	{
+	if (argcnt == 2 && strcmp (argvec[1], "on") == 0)
+		fs_set_discard (FS_DISCARD_ON);
+	else if (argcnt == 2 && strcmp (argvec[1], "off") == 0)
+		fs_set_discard (FS_DISCARD_OFF);
+	else if (argcnt != 1)
+		{
+		printf ("Usage: discard [on|off]\n");
+		return -1;
+		}
+
+	printf ("discard is %s\n", (fs_get_discard() == FS_DISCARD_ON) ? "on" : "off");
+	int64_t used = fs_volume_disk_usage();
+	if (used >= 0)
+		printf ("volume file takes %lld KiB on disk\n", (long long)(used / 1024));
+	return 0;
+	}
+
+/****************************************************
+*  Defrag commmand
+****************************************************/
+int cmd_defrag (int argcnt, char *argvec[])
+	{
+	struct b_defrag_stats st;
+	struct timespec start;
+	int rate = 4096;	// KiB/s, so that other I/O keeps going
+	char * path = ".";
+	int i = 1;
+
+	if (argcnt > 1 && strcmp (argvec[1], "-r") == 0)
+		{
+		rate = (argcnt > 2) ? atoi (argvec[2]) : -1;
+		i = 3;
+		}
+	if (argcnt > i)
+		path = argvec[i++];
+	if (argcnt > i || rate < 0)
+		{
+		printf ("Usage: defrag [-r KiB/s] [path]\n");
+		return -1;
+		}
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	if (b_defrag (path, rate, &st) != 0)
+		{
+		printf ("defrag: cannot find %s\n", path);
+		return -1;
+		}
+	double secs = benchSeconds (&start);
+	printf ("%ld files, %ld rewritten: %ld extents -> %ld, %ld blocks copied in %.3f s\n",
+		st.files, st.moved, st.extentsBefore, st.extentsAfter, st.blocks, secs);
+	if (st.busy > 0 || st.noRoom > 0)
+		printf ("skipped %ld open for writing, %ld without a free run long enough\n",
+			st.busy, st.noRoom);
+	return 0;
+	}
+
+/****************************************************
+*  Df commmand
+****************************************************/
+typedef struct dfFiles
+	{
+	long files;
+	long extents;
+	int most;			// extents of the most fragmented file
+	char mostPath[512];
+	} dfFiles;
+
+// count the extents of every file below path, listing them if list is set
+void dfWalk (char * path, int list, dfFiles * df)
+	{
+	struct fs_diriteminfo * di;
+	char child[512];
+	fdDir * dirp = fs_opendir (path);
+
+	if (dirp == NULL)
+		return;
+	while ((di = fs_readdir (dirp)) != NULL)
+		{
+		if (strcmp (di->d_name, ".") == 0 || strcmp (di->d_name, "..") == 0)
+			continue;
+		snprintf (child, sizeof(child), "%s%s%s", path,
+			(strcmp (path, "/") == 0) ? "" : "/", di->d_name);
+		if (di->fileType == FT_DIRECTORY)
+			{
+			dfWalk (child, list, df);
+			continue;
+			}
+		int e = fs_file_extents (child);
+		if (e < 0)
+			continue;
+		if (list)
+			printf ("%6d extents %10llu bytes  %s\n", e, (ull_t)di->size, child);
+		df->files++;
+		df->extents += e;
+		if (e > df->most)
+			{
+			df->most = e;
+			strcpy (df->mostPath, child);
+			}
+		}
+	fs_closedir (dirp);
+	}
+
+int cmd_df (int argcnt, char *argvec[])
+	{
+	struct fs_space_stats st;
+	int list = 0;
+
+	for (int i = 1; i < argcnt; i++)
+		{
+		if (strcmp (argvec[i], "-f") == 0)
+			list = 1;
+		else if (strcmp (argvec[i], "-c") == 0)
+			{
+			struct b_defrag_stats cs;
+			struct timespec start;
+			clock_gettime (CLOCK_MONOTONIC, &start);
+			b_compact (0, &cs);
+			printf ("compacted: %ld files moved, %ld blocks copied in %.3f s\n",
+				cs.moved, cs.blocks, benchSeconds (&start));
+			}
+		else
+			{
+			printf ("Usage: df [-f] [-c]\n");
+			return -1;
+			}
+		}
+
+	fs_space_stats (&st);
+	uint64_t dataBlocks = st.blocks - st.metaBlocks;
+	printf ("%llu blocks of %llu bytes, %llu of them VCB and FAT\n",
+		(ull_t)st.blocks, (ull_t)st.blockSize, (ull_t)st.metaBlocks);
+	printf ("free:           %10llu blocks %10llu KiB %5.1f%%\n",
+		(ull_t)st.freeBlocks, (ull_t)(st.freeBlocks * st.blockSize / 1024),
+		dataBlocks ? 100.0 * st.freeBlocks / dataBlocks : 0.0);
+	if (st.freeCounted != st.freeBlocks)
+		printf ("  but %llu free in the counts kept in memory\n", (ull_t)st.freeCounted);
+	printf ("largest run:    %10llu blocks %10llu KiB\n",
+		(ull_t)st.largestFree, (ull_t)(st.largestFree * st.blockSize / 1024));
+	printf ("free runs:      %10llu\n", (ull_t)st.freeExtents);
+	for (int b = 0; b < FS_SPACE_BUCKETS; b++)
+		{
+		if (st.freeRuns[b] == 0)
+			continue;
+		char range[32];
+		if (b == 0)
+			strcpy (range, "1");
+		else if (b + 1 == FS_SPACE_BUCKETS)
+			sprintf (range, "%llu+", 1ULL << b);
+		else
+			sprintf (range, "%llu-%llu", 1ULL << b, (2ULL << b) - 1);
+		printf ("  %-12s  %10llu runs\n", range, (ull_t)st.freeRuns[b]);
+		}
+
+	dfFiles df;
+	memset (&df, 0, sizeof(df));
+	dfWalk ("/", list, &df);
+	printf ("files:          %10ld in %ld extents, %.1f per file\n",
+		df.files, df.extents, df.files ? (double)df.extents / df.files : 0.0);
+	if (df.most > 1)
+		printf ("most fragmented: %s, %d extents\n", df.mostPath, df.most);
+	return 0;
+	}
+
+/****************************************************
+*  Bench commmand
+****************************************************/
+double benchSeconds (struct timespec * start)
+	{
+	struct timespec end;
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+	}
+
+// resolve the same path over and over
+int benchLookup (char * path, long count)
+	{
+	struct fs_perfstats before, after;
+	struct timespec start;
+	int found = 0;
+
+	fs_get_stats (&before);
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++)
+		{
+		struct fs_lookup_result result;
+		found += (fs_lookup (path, &result) == 0);
+		}
+	double secs = benchSeconds (&start);
+	fs_get_stats (&after);
+
+	// each iteration resolves the path once
+	printf ("%ld iterations (%s) in %.3f s\n", count,
+		found ? "found" : "not found", secs);
+	printf ("lookups/sec:           %.0f\n", count / secs);
+	printf ("allocations/lookup:    %.3f\n",
+		(double)(after.heapAllocs - before.heapAllocs) / count);
+	printf ("directory loads:       %llu\n",
+		(ull_t)(after.dirLoads - before.dirLoads));
+	return 0;
+	}
+
+// list the current directory with attributes, once per-entry with
+// fs_stat/fs_isDir and once with fs_readdirplus
+int benchLs (long count)
+	{
+	struct fs_perfstats before, after;
+	struct timespec start;
+	struct fs_diriteminfo * di;
+	struct fs_stat statbuf;
+	struct fs_direntplus batch[LSBATCH];
+	long entries = 0;
+	int n;
+
+	fs_get_stats (&before);
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++)
+		{
+		fdDir * dirp = fs_opendir (".");
+		while ((di = fs_readdir (dirp)) != NULL)
+			{
+			fs_stat (di->d_name, &statbuf);
+			entries += fs_isDir (di->d_name);
+			}
+		fs_closedir (dirp);
+		}
+	double secs = benchSeconds (&start);
+	fs_get_stats (&after);
+	printf ("fs_readdir+fs_stat+fs_isDir: %8.1f us/listing, %6.1f lookups/listing, %llu directory loads\n",
+		secs * 1e6 / count, (double)(after.lookups - before.lookups) / count,
+		(ull_t)(after.dirLoads - before.dirLoads));
+
+	fs_get_stats (&before);
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++)
+		{
+		fdDir * dirp = fs_opendir (".");
+		while ((n = fs_readdirplus (dirp, batch, LSBATCH)) > 0)
+			{
+			entries += n;
+			}
+		fs_closedir (dirp);
+		}
+	secs = benchSeconds (&start);
+	fs_get_stats (&after);
+	printf ("fs_readdirplus:              %8.1f us/listing, %6.1f lookups/listing, %llu directory loads\n",
+		secs * 1e6 / count, (double)(after.lookups - before.lookups) / count,
+		(ull_t)(after.dirLoads - before.dirLoads));
+	return (entries > 0) ? 0 : -1;
+	}
+
+// look up every name of the current directory, comparing names entry by
+// entry and with vectorized hash matching
+int benchScan (long count)
+	{
+	static char names[64][256];
+	struct fs_diriteminfo * di;
+	struct timespec start;
+	int nnames = 0;
+	long found = 0;
+
+	fdDir * dirp = fs_opendir (".");
+	while (((di = fs_readdir (dirp)) != NULL) && (nnames < 64))
+		{
+		strcpy (names[nnames++], di->d_name);
+		}
+
+	for (int mode = FS_SCAN_LINEAR; mode <= FS_SCAN_VECTOR; mode++)
+		{
+		fs_set_scan_mode (mode);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < count; i++)
+			{
+			for (int k = 0; k < nnames; k++)
+				{
+				found += (fs_findentry (dirp, names[k]) != NULL);
+				}
+			}
+		double secs = benchSeconds (&start);
+		printf ("%-8s %d names: %12.0f lookups/sec\n",
+			(mode == FS_SCAN_LINEAR) ? "linear" : "vector", nnames,
+			count * nnames / secs);
+		}
+	fs_closedir (dirp);
+	return (found > 0) ? 0 : -1;
+	}
+
+// grow writers files side by side in small writes, with and without
+// speculative preallocation, and count the extents each ends up in
+int benchFrag (int writers, long kib)
+	{
+	char name[32];
+	char buf[256];
+	struct timespec start;
+	int fds[writers];
+	int saved = b_get_prealloc ();
+
+	memset (buf, 'f', sizeof(buf));
+	for (int pass = 0; pass < 2; pass++)
+		{
+		b_set_prealloc (pass == 0 ? 0 : saved);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		for (int w = 0; w < writers; w++)
+			{
+			sprintf (name, "bench_frag_%d", w);
+			fds[w] = b_open (name, O_WRONLY | O_CREAT | O_TRUNC);
+			}
+		for (long n = 0; n < kib * 1024 / (long)sizeof(buf); n++)
+			{
+			for (int w = 0; w < writers; w++)
+				{
+				b_write (fds[w], buf, sizeof(buf));
+				}
+			}
+		for (int w = 0; w < writers; w++)
+			{
+			b_close (fds[w]);
+			}
+		double secs = benchSeconds (&start);
+
+		long extents = 0;
+		int most = 0;
+		for (int w = 0; w < writers; w++)
+			{
+			sprintf (name, "bench_frag_%d", w);
+			int e = fs_file_extents (name);
+			extents += e;
+			if (e > most)
+				most = e;
+			fs_delete (name);
+			}
+		printf ("prealloc %-3s %d files of %ld KiB: %6.1f extents/file (max %d), %.3f s\n",
+			(pass == 0) ? "off" : "on", writers, kib,
+			(double)extents / writers, most, secs);
+		}
+	b_set_prealloc (saved);
+	return 0;
+	}
+
+// fill dirs directories with files, created one per directory in turn,
+// then read each directory and its files back, with blocks allocated
+// from the lowest free block and in allocation groups
+int benchTree (int dirs, int files, long kib)
+	{
+	char name[64];
+	char buf[1024];
+	struct fs_perfstats before, after;
+	struct fs_rmtree_stats removed;
+	struct fs_diriteminfo * di;
+	struct timespec start;
+	int saved = fs_get_alloc_mode ();
+
+	memset (buf, 't', sizeof(buf));
+	for (int mode = FS_ALLOC_LINEAR; mode <= FS_ALLOC_GROUPS; mode++)
+		{
+		fs_set_alloc_mode (mode);
+		fs_mkdir ("bench_tree", 0777);
+		for (int d = 0; d < dirs; d++)
+			{
+			sprintf (name, "bench_tree/d%d", d);
+			fs_mkdir (name, 0777);
+			}
+		for (int f = 0; f < files; f++)
+			{
+			for (int d = 0; d < dirs; d++)
+				{
+				sprintf (name, "bench_tree/d%d/f%d", d, f);
+				int fd = b_open (name, O_WRONLY | O_CREAT | O_TRUNC);
+				for (long k = 0; k < kib; k++)
+					b_write (fd, buf, sizeof(buf));
+				b_close (fd);
+				}
+			}
+
+		// one directory at a time: list it and read its files
+		fs_get_stats (&before);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		for (int d = 0; d < dirs; d++)
+			{
+			sprintf (name, "bench_tree/d%d", d);
+			fdDir * dirp = fs_opendir (name);
+			while ((di = fs_readdir (dirp)) != NULL)
+				{
+				if (di->fileType != FT_REGFILE)
+					continue;
+				int fd = b_openat (dirp, di->d_name, O_RDONLY);
+				while (b_read (fd, buf, sizeof(buf)) > 0)
+					;
+				b_close (fd);
+				}
+			fs_closedir (dirp);
+			}
+		double secs = benchSeconds (&start);
+		fs_get_stats (&after);
+
+		uint64_t ios = after.ioCalls - before.ioCalls;
+		printf ("%-7s %d dirs x %d files of %ld KiB: %8.1f LBAs avg seek, %llu I/Os, %.3f s\n",
+			(mode == FS_ALLOC_LINEAR) ? "linear" : "groups", dirs, files, kib,
+			ios ? (double)(after.seekLBAs - before.seekLBAs) / ios : 0.0,
+			(ull_t)ios, secs);
+		fs_rmtree ("bench_tree", &removed);
+		}
+	fs_set_alloc_mode (saved);
+	return 0;
+	}
+
+typedef struct benchScaleArg
+	{
+	int fd;
+	long kib;
+	} benchScaleArg;
+
+void * benchScaleWriter (void * arg)
+	{
+	benchScaleArg * a = arg;
+	char buf[4096];
+
+	memset (buf, 's', sizeof(buf));
+	for (long k = 0; k < a->kib / 4; k++)
+		b_write (a->fd, buf, sizeof(buf));
+	return NULL;
+	}
+
+// write one file per thread, from 1 thread up to threads, with blocks
+// allocated from the lowest free block under one lock and from the
+// allocation groups, each thread in a group of its own
+int benchScale (int threads, long kib)
+	{
+	char name[32];
+	struct fs_perfstats before, after;
+	struct timespec start;
+	pthread_t tids[threads];
+	benchScaleArg args[threads];
+	int savedMode = fs_get_alloc_mode ();
+	int savedPrealloc = b_get_prealloc ();
+
+	// every block is allocated on its own, as the writes need it
+	b_set_prealloc (0);
+	for (int mode = FS_ALLOC_LINEAR; mode <= FS_ALLOC_GROUPS; mode++)
+		{
+		fs_set_alloc_mode (mode);
+		// 1, 2, 4 ... threads
+		for (int t = 1; t <= threads; t = (t < threads && t * 2 > threads) ? threads : t * 2)
+			{
+			for (int i = 0; i < t; i++)
+				{
+				sprintf (name, "bench_scale_%d", i);
+				args[i].fd = b_open (name, O_WRONLY | O_CREAT | O_TRUNC);
+				args[i].kib = kib;
+				}
+			fs_get_stats (&before);
+			clock_gettime (CLOCK_MONOTONIC, &start);
+			for (int i = 0; i < t; i++)
+				pthread_create (&tids[i], NULL, benchScaleWriter, &args[i]);
+			for (int i = 0; i < t; i++)
+				pthread_join (tids[i], NULL);
+			double secs = benchSeconds (&start);
+			fs_get_stats (&after);
+
+			for (int i = 0; i < t; i++)
+				{
+				b_close (args[i].fd);
+				sprintf (name, "bench_scale_%d", i);
+				fs_delete (name);
+				}
+			printf ("%-7s %2d writers of %ld KiB: %8.2f MiB/s, %llu lock waits\n",
+				(mode == FS_ALLOC_LINEAR) ? "linear" : "groups", t, kib,
+				t * kib / 1024.0 / secs,
+				(ull_t)(after.allocLockWaits - before.allocLockWaits));
+			}
+		}
+	fs_set_alloc_mode (savedMode);
+	b_set_prealloc (savedPrealloc);
+	return 0;
+	}
+
+int cmd_bench (int argcnt, char *argvec[])
+	{
+	if ((argcnt >= 3) && (strcmp(argvec[1], "lookup") == 0))
+		{
+		long count = (argcnt > 3) ? atol (argvec[3]) : 100000;
+		return (benchLookup (argvec[2], count));
+		}
+	if ((argcnt >= 2) && (strcmp(argvec[1], "ls") == 0))
+		{
+		long count = (argcnt > 2) ? atol (argvec[2]) : 1000;
+		return (benchLs (count));
+		}
+
+	if ((argcnt >= 2) && (strcmp(argvec[1], "scan") == 0))
+		{
+		long count = (argcnt > 2) ? atol (argvec[2]) : 10000;
+		return (benchScan (count));
+		}
+
+	if ((argcnt >= 2) && (strcmp(argvec[1], "frag") == 0))
+		{
+		int writers = (argcnt > 2) ? atoi (argvec[2]) : 8;
+		long kib = (argcnt > 3) ? atol (argvec[3]) : 64;
+		if (writers < 1 || writers > 16 || kib < 1)
+			{
+			printf ("bench frag: 1 to 16 writers of at least 1 KiB\n");
+			return -1;
+			}
+		return (benchFrag (writers, kib));
+		}
+
+	if ((argcnt >= 2) && (strcmp(argvec[1], "tree") == 0))
+		{
+		int dirs = (argcnt > 2) ? atoi (argvec[2]) : 8;
+		int files = (argcnt > 3) ? atoi (argvec[3]) : 16;
+		long kib = (argcnt > 4) ? atol (argvec[4]) : 16;
+		if (dirs < 1 || files < 1 || kib < 1)
+			{
+			printf ("bench tree: at least 1 directory, 1 file and 1 KiB\n");
+			return -1;
+			}
+		return (benchTree (dirs, files, kib));
+		}
+
+	if ((argcnt >= 2) && (strcmp(argvec[1], "scale") == 0))
+		{
+		int threads = (argcnt > 2) ? atoi (argvec[2]) : 4;
+		long kib = (argcnt > 3) ? atol (argvec[3]) : 256;
+		if (threads < 1 || threads > 16 || kib < 4)
+			{
+			printf ("bench scale: 1 to 16 threads of at least 4 KiB\n");
+			return -1;
+			}
+		return (benchScale (threads, kib));
+		}
+
+	printf ("Usage: bench lookup path [count]\n");
+	printf ("       bench ls [count]\n");
+	printf ("       bench scan [count]\n");
+	printf ("       bench frag [writers] [KiB]\n");
+	printf ("       bench tree [dirs] [files] [KiB]\n");
+	printf ("       bench scale [threads] [KiB]\n");
+	return -1;
+	}
+
 /****************************************************
 *  History commmand
 ****************************************************/
@@ -737,7 +1413,7 @@ int main (int argc, char * argv[])
 		}
 	else
 		{
-		printf ("Usage: fsLowDriver volumeFileName volumeSize blockSize\n");
+		printf ("Usage: fsLowDriver volumeFileName volumeSize blockSize [format] [cluster=KiB] [lowtest]\n");
 		return -1;
 		}
 		
@@ -750,6 +1426,20 @@ int main (int argc, char * argv[])
 		return (retVal);
 		}
 		
+	// block I/O and discard of freed blocks through a descriptor of our own
+	if (fs_volume_open (filename) != 0)
+		printf ("Cannot open %s for block I/O\n", filename);
+
+	// clusters of more than one block, if the volume gets formatted;
+	// formatting a volume that holds a file system has to be asked for
+	for (int i = 4; i < argc; i++)
+		{
+		if (strncmp ("cluster=", argv[i], 8) == 0)
+			fs_set_cluster_size (atoll (argv[i] + 8) * 1024);
+		if (strcmp ("format", argv[i]) == 0)
+			fs_set_format (1);
+		}
+
 	retVal = initFileSystem (volumeSize / blockSize, blockSize);
 	
 	if (retVal != 0)
@@ -759,8 +1449,8 @@ int main (int argc, char * argv[])
 		return (retVal);
 		}
 
-	if (argc > 4)
-		if(strcmp("lowtest", argv[4]) == 0)
+	for (int i = 4; i < argc; i++)
+		if(strcmp("lowtest", argv[i]) == 0)
 			runFSLowTest();
 
 
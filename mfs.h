@@ -42,6 +42,7 @@ struct fs_diriteminfo
 
 	uint64_t startLocationLBA;
 	uint64_t size;
+	uint32_t mapBlocks;		/* blocks of the block map of a sparse file, 0 if none */
 	};
 
 // This is a private structure used only by fs_opendir, fs_readdir, and fs_closedir
@@ -53,11 +54,15 @@ typedef struct
 	{
 	/*****TO DO:  Fill in this structure with what your open/read directory needs  *****/
 	unsigned short  d_reclen;		/*length of this record */
-	unsigned short	dirEntryPosition;	/*which directory entry position, like file pos */
+	unsigned short	dirEntryPosition;	/*which entry of the batch, like file pos */
 	uint64_t	directoryStartLocation;		/*Starting LBA of directory */
 	
         struct fs_diriteminfo itemInfo;
-        void *entries;          // entries of directory
+        void *entries;          // entries decoded from the batch of blocks
+        int batchSize;          // entries the batch can hold
+        int batchStart;         // first block of batch
+        int batchCount;         // entries in batch, -1 if not loaded
+        int dirBlocks;          // blocks of the directory holding records
         } fdDir;
 
 char * parsePath(char *pathname);
@@ -71,6 +76,7 @@ int fs_rmdir(const char *pathname);
 fdDir * fs_opendir(const char *pathname);
 struct fs_diriteminfo *fs_readdir(fdDir *dirp);
 int fs_closedir(fdDir *dirp);
+struct fs_diriteminfo *fs_findentry(fdDir *dirp, const char *name);	// NULL if not found
 
 // Misc directory functions
 char * fs_getcwd(char *pathname, size_t size);
@@ -81,9 +87,27 @@ int fs_delete(char* filename);	//removes a file
 struct fs_diriteminfo *fs_create(fdDir * dir, char * filename);   // create a file
 
 int fs_set_fileSize(fdDir * dir, char * filename, int size);
+int fs_truncate_file(fdDir * dir, char * filename);	// drops all data, keeps the file
+
+// Files of at most FS_INLINE_MAX bytes keep their data in the directory
+// and have no blocks (startLocationLBA 0)
+#define FS_INLINE_MAX	60
+int fs_get_inline(fdDir * dir, char * filename, char * buffer);	// returns size
+int fs_set_inline(fdDir * dir, char * filename, char * buffer, int size);
+int fs_set_fileLocation(fdDir * dir, char * filename, uint64_t location);	// gives it blocks
+
+// A sparse file, or one with blocks reserved past its end, records the
+// size of its block map and the blocks it takes, which fs_stat reports as
+// st_blocks. Counts of 0 drop the record. Fails if the directory has no
+// room left to record them.
+int fs_set_fileMap(fdDir * dir, char * filename, uint32_t mapBlocks, uint32_t allocBlocks);
 
 int fs_rename(char * src, char * dest);
 
+// Directory changes made between these calls are written once, at the end
+void fs_batch_begin(void);
+void fs_batch_end(void);
+
 // This is the strucutre that is filled in from a call to fs_stat
 struct fs_stat
 	{
@@ -99,14 +123,177 @@ struct fs_stat
 
 int fs_stat(const char *path, struct fs_stat *buf);
 
+// This structure is filled in by fs_readdirplus: the next entry of a
+// directory together with its status, so listing a directory does not
+// need a fs_stat call per entry
+struct fs_direntplus
+	{
+	struct fs_diriteminfo item;	/* name, type, start LBA and size */
+	struct fs_stat st;
+	};
+
+// fills up to count entries, returns how many (0 at end of directory)
+int fs_readdirplus(fdDir *dirp, struct fs_direntplus *buf, int count);
+
+// This structure is filled in by fs_lookup: everything about a path,
+// found with a single walk of the path
+struct fs_lookup_result
+	{
+	struct fs_diriteminfo item;	/* name, type, start LBA and size */
+	struct fs_stat st;
+	uint64_t parentLocation;	/* start LBA of the directory holding it */
+	};
+
+// 0 if path exists. On a miss item.d_name holds the missing name and
+// parentLocation its directory (0 if that is missing too), so the caller
+// can create it without walking the path again. A last name too long for
+// a directory entry, or a path ending in '/' that is not a directory,
+// fails with a code of its own and nothing to create.
+#define FS_LOOKUP_TOOLONG	-2
+#define FS_LOOKUP_NOTDIR	-3
+int fs_lookup(const char *path, struct fs_lookup_result *result);
+fdDir * fs_opendir_lookup(const struct fs_lookup_result *result);	// the directory itself
+fdDir * fs_opendir_parent(const struct fs_lookup_result *result);	// directory holding it
+int fs_remove(fdDir *dirp, const char *name);	// removes a file or empty directory
+
+// Removes path and, for a directory, everything below it
+struct fs_rmtree_stats
+	{
+	uint64_t entries;		/* files and directories removed */
+	uint64_t blocks;		/* blocks freed */
+	};
+int fs_rmtree(const char *pathname, struct fs_rmtree_stats *stats);
+
+// Free space, from a scan of the FAT
+#define FS_SPACE_BUCKETS	16
+struct fs_space_stats
+	{
+	uint64_t blocks;		/* blocks of the volume */
+	uint64_t blockSize;
+	uint64_t metaBlocks;		/* blocks of the VCB and the FAT */
+	uint64_t freeBlocks;
+	uint64_t freeCounted;		/* free blocks as counted in memory, same unless broken */
+	uint64_t freeExtents;		/* runs of free blocks */
+	uint64_t largestFree;		/* blocks of the longest run */
+	uint64_t freeRuns[FS_SPACE_BUCKETS];	/* runs of 1, 2-3, 4-7 ... blocks */
+	};
+int fs_space_stats(struct fs_space_stats *st);
+void fs_reclaim(void);		// frees the blocks of deleted files now
+
+// Runs of consecutive blocks holding the file at path, -1 if it is not a
+// file
+int fs_file_extents(const char *path);
+
+// Variants working on a single name inside an open directory, without
+// resolving any path
+#define FS_AT_REMOVEDIR	1	// fs_unlinkat removes a directory instead of a file
+b_io_fd b_openat(fdDir *dirp, char *name, int flags);
+int fs_mkdirat(fdDir *dirp, const char *name, mode_t mode);
+int fs_unlinkat(fdDir *dirp, const char *name, int flags);
+int fs_statat(fdDir *dirp, const char *name, struct fs_stat *buf);
+int fs_renameat(fdDir *srcDirp, const char *src, fdDir *destDirp, const char *dest);
+fdDir * fs_dupdir(fdDir *dirp);		// new cursor on the same directory
+
+// Counters of the file system, reported by the "stats" shell command
+struct fs_perfstats
+	{
+	uint64_t lookups;		/* name lookups in a directory */
+	uint64_t negCacheHits;		/* misses answered by the negative cache */
+	uint64_t bloomRejects;		/* misses answered by the Bloom filter */
+	uint64_t bloomFalsePositives;	/* Bloom filter passed a name not in directory */
+	uint64_t entryScans;		/* lookups that scanned directory entries */
+	uint64_t dirLoads;		/* directories read from disk */
+	uint64_t dirBlockReads;		/* directory blocks read by fs_readdir */
+	uint64_t dirBlockWrites;	/* directory blocks written */
+	uint64_t heapAllocs;		/* heap allocations made opening directories */
+	uint64_t fatBlockWrites;	/* FAT blocks written */
+	uint64_t chainsDeferred;	/* deleted chains queued for the reclaimer */
+	uint64_t blocksReclaimed;	/* blocks freed by the reclaimer */
+	uint64_t discardCalls;		/* extents punched out of the volume file */
+	uint64_t blocksDiscarded;	/* blocks punched out of the volume file */
+	uint64_t ioCalls;		/* reads and writes of data and directory blocks */
+	uint64_t seekLBAs;		/* LBAs between the end of each of them and the next */
+	uint64_t allocLockWaits;	/* allocations that found an allocation group locked */
+	};
+
+void fs_get_stats(struct fs_perfstats *stats);
+void fs_reset_stats(void);
+
+// How directory lookups match names (for benchmarking)
+#define FS_SCAN_LINEAR	0	/* compare the name of every entry */
+#define FS_SCAN_VECTOR	1	/* SIMD compare of packed name hashes first */
+void fs_set_scan_mode(int mode);
+
+// Where blocks are allocated (for benchmarking)
+#define FS_ALLOC_LINEAR	0	/* from the lowest free block */
+#define FS_ALLOC_GROUPS	1	/* a file in the allocation group of its directory */
+void fs_set_alloc_mode(int mode);
+int fs_get_alloc_mode(void);
+
+// The volume file opened once more, for block I/O from several threads at
+// once and for discard
+int fs_volume_open(const char *volumeFile);	/* before initFileSystem */
+
+// Freed blocks are punched out of the host volume file, so that it only
+// takes disk space for blocks in use
+#define FS_DISCARD_OFF	0
+#define FS_DISCARD_ON	1
+void fs_set_discard(int mode);
+int fs_get_discard(void);
+int64_t fs_volume_disk_usage(void);	/* bytes of the volume file on disk, -1 if unknown */
+
+// Block I/O of the volume, safe to use from several threads
+uint64_t fs_lba_read(void *buffer, uint64_t lbaCount, uint64_t lbaPosition);
+uint64_t fs_lba_write(void *buffer, uint64_t lbaCount, uint64_t lbaPosition);
+
+// Blocks of the file system are clusters of one or more LBAs, each block
+// one entry of the FAT. The size is chosen when the volume is formatted,
+// a power of 2 up to 64 KiB.
+void fs_set_cluster_size(uint64_t bytes);	/* before initFileSystem, 0 for one LBA */
+
+// A volume holding a file system of another format version is not
+// mounted, unless formatting was asked for: that erases it
+void fs_set_format(int format);		/* before initFileSystem */
+uint64_t fs_block_read(void *buffer, uint64_t blockCount, uint64_t blockPosition);
+uint64_t fs_block_write(void *buffer, uint64_t blockCount, uint64_t blockPosition);
+uint64_t fs_lba_block(uint64_t lbaPosition);	/* block starting at an LBA */
+
+// Blocks of a file. A file with holes (a sparse file) has a block map:
+// its chain starts with the map blocks, which give the block of every
+// block of the file, followed by its data blocks in any order. Any other
+// file is just its chain, in order. Blocks reserved and not written yet
+// are marked unwritten, in the map too, and read as zeros.
 typedef struct {
 	int block_size;
-	int total_blocks;
-	int *table_blocknumbers;
+	int total_blocks;		// blocks of the file, holes and reserved blocks included
+	int *table_blocknumbers;	// block of each, 0 for a hole
+	unsigned char *unwritten;	// 1 for each block not written yet, NULL if none
+	int unwritten_size;		// entries of unwritten
+	int map_blocks;			// blocks of the map, 0 if the file has none
+	int *map_blocknumbers;
+	int alloc_blocks;		// blocks in the chain, map included
+	int head_block;			// first and last block of the chain, 0 if none
+	int tail_block;
+	int unordered;			// chain of a file without map out of file order
+	int dir_lba;			// start of its directory, new blocks go near it
 } fat_file_blockinfo;
 
 fat_file_blockinfo * fat_get_file_blockinfo(int startBlockNumber);
-int fat_add_block(fat_file_blockinfo *bi);
+fat_file_blockinfo * fat_get_file_map(int startBlockNumber, int mapBlocks, uint64_t fileSize);
+fat_file_blockinfo * fat_new_file_blockinfo(void);
+void fat_free_file_blockinfo(fat_file_blockinfo *bi);
+int fat_add_block(fat_file_blockinfo *bi);	// -1 if the volume is full
+int fat_is_hole(fat_file_blockinfo *bi, int index);
+int fat_is_unwritten(fat_file_blockinfo *bi, int index);
+void fat_set_unwritten(fat_file_blockinfo *bi, int index, int unwritten);
+int fat_map_block(fat_file_blockinfo *bi, int index);	// allocates a hole, 0 if full
+int fat_reserve_blocks(fat_file_blockinfo *bi, int first, int last);	// fills holes in one run, unwritten; -1 if no room
+int fat_trim_blocks(fat_file_blockinfo *bi, int from);	// frees blocks from index from on
+int fat_put_file_map(fat_file_blockinfo *bi);	// -1 if the file needs no map
+void fat_make_plain(fat_file_blockinfo *bi);	// fills the holes, drops the map
+int fat_alloc_run(fat_file_blockinfo *bi, int count);	// chained in order, 0 if no run
+int fat_alloc_low_run(int count, int below);	// lowest run, if before block below
+void fat_free_chain(int head);	// once the reclaimer runs
 
 #endif
 